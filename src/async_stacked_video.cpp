@@ -1,7 +1,9 @@
 #include <cstdlib>
+#include <cerrno>
 #include <node_buffer.h>
 #include "common.h"
 #include "utils.h"
+#include "rle.h"
 #include "async_stacked_video.h"
 
 #include "loki/ScopeGuard.h"
@@ -9,15 +11,32 @@
 using namespace v8;
 using namespace node;
 
+// seconds between progress callbacks
+static const double PROGRESS_INTERVAL = 0.25;
+
 AsyncStackedVideo::AsyncStackedVideo(int wwidth, int hheight) :
     width(wwidth), height(hheight), videoEncoder(wwidth, hheight),
-    push_id(0), fragment_id(0) {}
+    push_id(0), fragment_id(0), writing(false), incremental(false),
+    encoding(false), two_pass(false), frame(NULL), last_timestamp(0), encode_error(NULL),
+    final_req(NULL),
+    ended(false), progress_active(false), aborted(false), frames_encoded(0),
+    frames_at_start(0), pass(1), encode_started(0), pass_started(0),
+    last_progress(0),
+    composite_time(0), encode_time(0)
+{
+    pthread_mutex_init(&progress_lock, NULL);
+    encoder_stats = videoEncoder.getStats();
+}
+
+AsyncStackedVideo::~AsyncStackedVideo()
+{
+    free(frame);
+    free(encode_error);
+    segment_callback.Dispose();
+    pthread_mutex_destroy(&progress_lock);
+}
 
-#if NODE_VERSION_AT_LEAST(0,6,0)
 void
-#else
-int
-#endif
 AsyncStackedVideo::Initialize(Handle<Object> target)
 {
     HandleScope scope;
@@ -25,92 +44,120 @@ AsyncStackedVideo::Initialize(Handle<Object> target)
     Local<FunctionTemplate> t = FunctionTemplate::New(New);
     t->InstanceTemplate()->SetInternalFieldCount(1);
     NODE_SET_PROTOTYPE_METHOD(t, "push", Push);
+    NODE_SET_PROTOTYPE_METHOD(t, "pushMany", PushMany);
     NODE_SET_PROTOTYPE_METHOD(t, "endPush", EndPush);
     NODE_SET_PROTOTYPE_METHOD(t, "setOutputFile", SetOutputFile);
     NODE_SET_PROTOTYPE_METHOD(t, "setQuality", SetQuality);
+    NODE_SET_PROTOTYPE_METHOD(t, "setBitrate", SetBitrate);
+    NODE_SET_PROTOTYPE_METHOD(t, "setSpeed", SetSpeed);
+    NODE_SET_PROTOTYPE_METHOD(t, "setAutoSpeed", SetAutoSpeed);
+    NODE_SET_PROTOTYPE_METHOD(t, "setGovernor", SetGovernor);
+    NODE_SET_PROTOTYPE_METHOD(t, "stats", Stats);
     NODE_SET_PROTOTYPE_METHOD(t, "setFrameRate", SetFrameRate);
     NODE_SET_PROTOTYPE_METHOD(t, "setKeyFrameInterval", SetKeyFrameInterval);
+    NODE_SET_PROTOTYPE_METHOD(t, "setMaxKeyFrameInterval", SetMaxKeyFrameInterval);
+    NODE_SET_PROTOTYPE_METHOD(t, "setSceneChangeThreshold", SetSceneChangeThreshold);
+    NODE_SET_PROTOTYPE_METHOD(t, "setCrop", SetCrop);
+    NODE_SET_PROTOTYPE_METHOD(t, "setSegments", SetSegments);
     NODE_SET_PROTOTYPE_METHOD(t, "setTmpDir", SetTmpDir);
+    NODE_SET_PROTOTYPE_METHOD(t, "setMemoryLimit", SetMemoryLimit);
+    NODE_SET_PROTOTYPE_METHOD(t, "setIncrementalEncoding", SetIncrementalEncoding);
+    NODE_SET_PROTOTYPE_METHOD(t, "setFragmentCompression", SetFragmentCompression);
+    NODE_SET_PROTOTYPE_METHOD(t, "setTwoPass", SetTwoPass);
     NODE_SET_PROTOTYPE_METHOD(t, "encode", Encode);
-    target->Set(String::NewSymbol("AsyncStackedVideo"), t->GetFunction());
+    NODE_SET_PROTOTYPE_METHOD(t, "abort", Abort);
+
+    Local<Function> constructor = t->GetFunction();
+    NODE_SET_METHOD(constructor, "recover", Recover);
+    target->Set(String::NewSymbol("AsyncStackedVideo"), constructor);
 }
 
-#if NODE_VERSION_AT_LEAST(0,6,0)
 void
-#else
-int
-#endif
-AsyncStackedVideo::EIO_Push(eio_req *req)
+AsyncStackedVideo::UV_Write(uv_work_t *req)
 {
-    push_request *push_req = (push_request *)req->data;
-
-    if (!is_dir(push_req->tmp_dir)) {
-        if (mkdir(push_req->tmp_dir, 0775) == -1) {
-            // there is no way to return this error to node as this call was
-            // async with no callback
-            fprintf(stderr, "Could not mkdir(%s) in AsyncStackedVideo::EIO_Push.\n",
-                push_req->tmp_dir);
-            #if NODE_VERSION_AT_LEAST(0,6,0)
-            return;
-            #else
-            return 0;
-            #endif
-        }
+    write_request *write_req = (write_request *)req->data;
+    FragmentStore *store = write_req->batch->store;
+
+    if (!store->write(write_req->batch)) {
+        // there is no way to return this error to node as this call was
+        // async with no callback
+        fprintf(stderr, "Failed to write %d frames to %s in "
+            "AsyncStackedVideo::UV_Write, keeping them in memory. Error: %s.\n",
+            (int)write_req->batch->frames.size(), store->journalPath(),
+            strerror(errno));
     }
+}
 
-    char fragment_dir[512];
-    snprintf(fragment_dir, 512, "%s/%d", push_req->tmp_dir, push_req->push_id);
+void
+AsyncStackedVideo::UV_WriteAfter(AFTER_WORK_ARGS)
+{
+    write_request *write_req = (write_request *)req->data;
+    AsyncStackedVideo *video = write_req->video_obj;
 
-    if (!is_dir(fragment_dir)) {
-        if (mkdir(fragment_dir, 0775) == -1) {
-            fprintf(stderr, "Could not mkdir(%s) in AsyncStackedVideo::EIO_Push.\n",
-                fragment_dir);
-            #if NODE_VERSION_AT_LEAST(0,6,0)
-            return;
-            #else
-            return 0;
-            #endif
-        }
-    }
+    delete write_req->batch;
+    free(write_req);
 
-    char filename[512];
-    snprintf(filename, 512, "%s/%d/rect-%d-%d-%d-%d-%d.dat",
-        push_req->tmp_dir, push_req->push_id, push_req->fragment_id,
-        push_req->x, push_req->y, push_req->w, push_req->h);
-    FILE *out = fopen(filename, "w+");
-    LOKI_ON_BLOCK_EXIT(fclose, out);
-    if (!out) {
-        fprintf(stderr, "Failed to open %s in AsyncStackedVideo::EIO_Push.\n",
-            filename);
-        #if NODE_VERSION_AT_LEAST(0,6,0)
-        return;
-        #else
-        return 0;
-        #endif
+    video->writing = false;
+    try {
+        video->StartWriter();
     }
-    int written = fwrite(push_req->data, sizeof(unsigned char), push_req->data_size, out);
-    if (written != push_req->data_size) {
-        fprintf(stderr, "Failed to write all data to %s. Wrote only %d of %d.\n",
-            filename, written, push_req->data_size);
+    catch (const char *err) {
+        fprintf(stderr, "%s\n", err);
+    }
+
+    if (video->incremental)
+        video->ScheduleEncode();
+    video->FinishEncode();
+    video->Unref();
+}
+
+void
+AsyncStackedVideo::Spill()
+{
+    if (tmp_dir.empty())
+        throw "Memory limit exceeded and tmp dir is not set. Use .setTmpDir to set it.";
+
+    if (!store.isOpen()) {
+        StoreHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = StoreHeader::MAGIC;
+        header.version = StoreHeader::VERSION;
+        header.width = width;
+        header.height = height;
+        header.frame_rate = videoEncoder.getFrameRate();
+        header.quality = videoEncoder.getQuality();
+        header.keyframe_interval = videoEncoder.getKeyFrameInterval();
+        videoEncoder.getCrop(header.crop_x, header.crop_y, header.crop_w, header.crop_h);
+        videoEncoder.getBitrate(header.bitrate, header.rate_buffer, header.rate_flags);
+
+        if (!store.open(tmp_dir.c_str(), header))
+            throw "Failed to create fragment journal in tmp dir in AsyncStackedVideo::Spill.";
     }
 
-    #if NODE_VERSION_AT_LEAST(0,6,0)
-    return;
-    #else
-    return 0;
-    #endif
+    store.queueWrite();
+    StartWriter();
 }
 
-int
-AsyncStackedVideo::EIO_PushAfter(eio_req *req)
+// There is at most one write in flight per video. Frames spilled meanwhile
+// wait in the store's queue and all go out with the next write, so the
+// journal stays in push order and a busy pusher makes few large writes.
+void
+AsyncStackedVideo::StartWriter()
 {
-    ev_unref(EV_DEFAULT_UC);
+    if (writing || !store.hasQueuedWrites())
+        return;
 
-    push_request *push_req = (push_request *)req->data;
-    free(push_req->data);
-    free(push_req);
+    write_request *write_req = (write_request *)malloc(sizeof(*write_req));
+    if (!write_req)
+        throw "malloc in AsyncStackedVideo::StartWriter failed.";
 
-    return 0;
+    write_req->video_obj = this;
+    write_req->batch = store.takeBatch();
+    write_req->work.data = write_req;
+
+    writing = true;
+    uv_queue_work(uv_default_loop(), &write_req->work, UV_Write, UV_WriteAfter);
+    Ref();
 }
 
 Handle<Value>
@@ -118,64 +165,160 @@ AsyncStackedVideo::Push(unsigned char *rect, int x, int y, int w, int h)
 {
     HandleScope scope;
 
-    if (tmp_dir.empty())
-        throw "Tmp dir is not set. Use .setTmpDir to set it before pushing.";
-
-    push_request *push_req = (push_request *)malloc(sizeof(*push_req));
-    if (!push_req)
-        throw "malloc in AsyncStackedVideo::Push failed.";
-
-    push_req->data = (unsigned char *)malloc(sizeof(*push_req->data)*w*h*3);
-    if (!push_req->data) {
-        free(push_req);
-        throw "malloc in AsyncStackedVideo::Push failed.";
-    }
+    // frames pushed now would never be encoded
+    if (ended)
+        throw "Video already ended, encode was called.";
 
-    memcpy(push_req->data, rect, w*h*3);
-    push_req->push_id = push_id;
-    push_req->fragment_id = fragment_id++;
-    push_req->tmp_dir = tmp_dir.c_str();
-    push_req->data_size = w*h*3;
-    push_req->x = x;
-    push_req->y = y;
-    push_req->w = w;
-    push_req->h = h;
+    if (!store.memoryLimit() && tmp_dir.empty())
+        throw "Tmp dir is not set. Use .setTmpDir to set it before pushing.";
 
-    eio_custom(EIO_Push, EIO_PRI_DEFAULT, EIO_PushAfter, push_req);
-    ev_ref(EV_DEFAULT_UC);
+    store.keep(push_id, fragment_id++, x, y, w, h, rect, w*h*3);
 
     return Undefined();
 }
 
+void
+AsyncStackedVideo::PushMany(unsigned char *buf, const RectList &rects)
+{
+    const int32_t *r = rects.rects;
+    for (int i = 0; i < rects.count; i++, r += 5)
+        Push(buf + r[4], r[0], r[1], r[2], r[3]);
+}
+
 void
 AsyncStackedVideo::EndPush(unsigned long timeStamp)
 {
+    if (ended)
+        throw "Video already ended, encode was called.";
+
+    store.endFrame(push_id, timeStamp);
     push_id++;
     fragment_id = 0;
+
+    if (store.memoryUsed() > store.memoryLimit())
+        Spill();
+
+    if (incremental)
+        ScheduleEncode();
 }
 
 void
 AsyncStackedVideo::SetOutputFile(const char *fileName)
 {
+    if (encoding)
+        throw "Output file can't be changed while encoding.";
     videoEncoder.setOutputFile(fileName);
 }
 
 void
 AsyncStackedVideo::SetQuality(int quality)
 {
-    videoEncoder.setQuality(quality);
+    EncoderSetting setting = { EncoderSetting::QUALITY, { quality, 0, 0 }, 0 };
+    ChangeSetting(setting);
+}
+
+void
+AsyncStackedVideo::SetBitrate(int bitrate, int bufferDelay, int flags)
+{
+    EncoderSetting setting = { EncoderSetting::BITRATE, { bitrate, bufferDelay, flags }, 0 };
+    ChangeSetting(setting);
+}
+
+void
+AsyncStackedVideo::SetSpeed(int speed)
+{
+    EncoderSetting setting = { EncoderSetting::SPEED, { speed, 0, 0 }, 0 };
+    ChangeSetting(setting);
+}
+
+void
+AsyncStackedVideo::SetAutoSpeed(bool enabled)
+{
+    EncoderSetting setting = { EncoderSetting::AUTO_SPEED, { enabled, 0, 0 }, 0 };
+    ChangeSetting(setting);
+}
+
+void
+AsyncStackedVideo::SetGovernor(bool enabled)
+{
+    EncoderSetting setting = { EncoderSetting::GOVERNOR, { enabled, 0, 0 }, 0 };
+    ChangeSetting(setting);
 }
 
 void
 AsyncStackedVideo::SetFrameRate(int frameRate)
 {
-    videoEncoder.setFrameRate(frameRate);
+    EncoderSetting setting = { EncoderSetting::FRAME_RATE, { frameRate, 0, 0 }, 0 };
+    ChangeSetting(setting);
 }
 
 void
 AsyncStackedVideo::SetKeyFrameInterval(int keyFrameInterval)
 {
-    videoEncoder.setKeyFrameInterval(keyFrameInterval);
+    EncoderSetting setting = { EncoderSetting::KEYFRAME_INTERVAL, { keyFrameInterval, 0, 0 }, 0 };
+    ChangeSetting(setting);
+}
+
+void
+AsyncStackedVideo::SetMaxKeyFrameInterval(int interval)
+{
+    EncoderSetting setting = { EncoderSetting::MAX_KEYFRAME_INTERVAL, { interval, 0, 0 }, 0 };
+    ChangeSetting(setting);
+}
+
+void
+AsyncStackedVideo::SetSceneChangeThreshold(double threshold)
+{
+    EncoderSetting setting = { EncoderSetting::SCENE_CHANGE_THRESHOLD, { 0, 0, 0 }, threshold };
+    ChangeSetting(setting);
+}
+
+void
+AsyncStackedVideo::SetSegments(double seconds, unsigned long long bytes)
+{
+    if (encoding)
+        throw "Segments can't be changed while encoding.";
+    videoEncoder.setSegments(seconds, bytes);
+}
+
+void
+AsyncStackedVideo::SetCrop(int x, int y, int w, int h)
+{
+    if (encoding)
+        throw "Crop can't be changed after the first frame.";
+    videoEncoder.setCrop(x, y, w, h);
+}
+
+void
+AsyncStackedVideo::SetMemoryLimit(size_t limit)
+{
+    store.setMemoryLimit(limit);
+}
+
+void
+AsyncStackedVideo::SetIncrementalEncoding(bool enabled)
+{
+    incremental = enabled;
+}
+
+void
+AsyncStackedVideo::SetFragmentCompression(bool enabled)
+{
+    store.setCompression(enabled);
+}
+
+void
+AsyncStackedVideo::SetTwoPass(bool enabled)
+{
+    two_pass = enabled;
+}
+
+void
+AsyncStackedVideo::Abort()
+{
+    pthread_mutex_lock(&progress_lock);
+    aborted = true;
+    pthread_mutex_unlock(&progress_lock);
 }
 
 Handle<Value>
@@ -256,13 +399,66 @@ AsyncStackedVideo::Push(const Arguments &args)
     return Undefined();
 }
 
+Handle<Value>
+AsyncStackedVideo::PushMany(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 2)
+        return VException("Two arguments required - buffer, rectangles.");
+
+    if (!Buffer::HasInstance(args[0]))
+        return VException("First argument must be Buffer.");
+
+    RectList rects;
+    if (!rect_list_from_value(args[1], rects))
+        return VException("Second argument must be Int32Array, Buffer or Array of (x, y, width, height, offset) tuples.");
+
+    AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
+    v8::Handle<v8::Object> rgb = args[0]->ToObject();
+
+    char error[256];
+    if (!check_rect_list(rects, Buffer::Length(rgb), video->width, video->height,
+        error, sizeof(error)))
+    {
+        return VException(error);
+    }
+
+    try {
+        video->PushMany((unsigned char *) Buffer::Data(rgb), rects);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+
+    return Undefined();
+}
+
 Handle<Value>
 AsyncStackedVideo::EndPush(const Arguments &args)
 {
     HandleScope scope;
 
+    unsigned long timeStamp = 0;
+
+    if (args.Length() == 1) {
+        if (!args[0]->IsNumber())
+            return VException("First argument (if present) must be int64 timestamp (measured in milliseconds).");
+
+        timeStamp = args[0]->IntegerValue();
+
+        if (timeStamp < 0)
+            return VException("Timestamp can't be negative.");
+    }
+
     AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
-    video->EndPush();
+
+    try {
+        video->EndPush(timeStamp);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
 
     return Undefined();
 }
@@ -278,7 +474,12 @@ AsyncStackedVideo::SetOutputFile(const Arguments &args)
     String::AsciiValue fileName(args[0]->ToString());
 
     AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
-    video->SetOutputFile(*fileName);
+    try {
+        video->SetOutputFile(*fileName);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
 
     return Undefined();
 }
@@ -300,231 +501,834 @@ AsyncStackedVideo::SetQuality(const Arguments &args)
     if (q > 63) return VException("Quality greater than 63.");
 
     AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
-    video->SetQuality(q);
+    try {
+        video->SetQuality(q);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
 
     return Undefined();
 }
 
 Handle<Value>
-AsyncStackedVideo::SetFrameRate(const Arguments &args)
+AsyncStackedVideo::SetBitrate(const Arguments &args)
 {
     HandleScope scope;
 
-    if (args.Length() != 1) 
-        return VException("Two argument required - frame rate.");
+    if (args.Length() < 1)
+        return VException("At least one argument required - bitrate in bits per second.");
 
     if (!args[0]->IsInt32())
-        return VException("Frame rate must be integer.");
+        return VException("Bitrate must be integer.");
 
-    int rate = args[0]->Int32Value();
+    int bitrate = args[0]->Int32Value();
+
+    if (bitrate < 0) return VException("Bitrate smaller than 0.");
+
+    int bufferDelay, flags;
+    const char *error = rate_options_from_value(args[1], bufferDelay, flags);
+    if (error)
+        return VException(error);
 
     AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
-    video->SetFrameRate(rate);
+    try {
+        video->SetBitrate(bitrate, bufferDelay, flags);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
 
     return Undefined();
 }
 
 Handle<Value>
-AsyncStackedVideo::SetKeyFrameInterval(const Arguments &args)
+AsyncStackedVideo::SetSpeed(const Arguments &args)
 {
     HandleScope scope;
 
-    if (args.Length() != 1) 
-        return VException("One argument required - keyframe interval.");
+    if (args.Length() != 1)
+        return VException("One argument required - encoder speed level.");
 
     if (!args[0]->IsInt32())
-        return VException("Keyframe interval must be integer.");
-
-    int interval = args[0]->Int32Value();
+        return VException("Speed level must be integer.");
 
-    if (interval < 0)
-        return VException("Keyframe interval must be positive.");
+    int speed = args[0]->Int32Value();
 
-    if ((interval & (interval - 1)) != 0)
-        return VException("Keyframe interval must be a power of two.");
+    if (speed < 0) return VException("Speed level smaller than 0.");
 
     AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
-    video->SetKeyFrameInterval(interval);
+    try {
+        video->SetSpeed(speed);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
 
     return Undefined();
 }
 
 Handle<Value>
-AsyncStackedVideo::SetTmpDir(const Arguments &args)
+AsyncStackedVideo::SetAutoSpeed(const Arguments &args)
 {
     HandleScope scope;
 
     if (args.Length() != 1)
-        return VException("One argument required - path to tmp dir.");
-
-    if (!args[0]->IsString())
-        return VException("First argument must be string.");
+        return VException("One argument required - true or false.");
 
-    String::AsciiValue tmp_dir(args[0]->ToString());
+    if (!args[0]->IsBoolean())
+        return VException("First argument must be boolean.");
 
     AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
-    video->tmp_dir = *tmp_dir;
+    try {
+        video->SetAutoSpeed(args[0]->BooleanValue());
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
 
     return Undefined();
 }
 
-int
-fragment_sort(const void *aa, const void *bb)
+Handle<Value>
+AsyncStackedVideo::SetGovernor(const Arguments &args)
 {
-    const char *a = *(const char **)aa;
-    const char *b = *(const char **)bb;
-    int na, nb;
-    sscanf(a, "rect-%d", &na);
-    sscanf(b, "rect-%d", &nb);
-    return na > nb;
-}
+    HandleScope scope;
 
-void
-AsyncStackedVideo::push_fragment(unsigned char *frame, int width, int height,
-    unsigned char *fragment, int x, int y, int w, int h)
-{
-    int start = y*width*3 + x*3;
-    unsigned char *fragmentp = fragment;
+    if (args.Length() != 1)
+        return VException("One argument required - true or false.");
 
-    for (int i = 0; i < h; i++) {
-        unsigned char *framep = &frame[start + i*width*3];
-        for (int j = 0; j < w; j++) {
-            *framep++ = *fragment++;
-            *framep++ = *fragment++;
-            *framep++ = *fragment++;
-        }
+    if (!args[0]->IsBoolean())
+        return VException("First argument must be boolean.");
+
+    AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
+    try {
+        video->SetGovernor(args[0]->BooleanValue());
+    }
+    catch (const char *err) {
+        return VException(err);
     }
+
+    return Undefined();
 }
 
-Rect
-AsyncStackedVideo::rect_dims(const char *fragment_name)
+Handle<Value>
+AsyncStackedVideo::Stats(const Arguments &args)
 {
-    int moo, x, y, w, h;
-    sscanf(fragment_name, "rect-%d-%d-%d-%d-%d", &moo, &x, &y, &w, &h);
-    return Rect(x, y, w, h);
-}
+    HandleScope scope;
+
+    AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
 
+    // the encoder may be running on a work thread, use the last snapshot
+    pthread_mutex_lock(&video->progress_lock);
+    EncoderStats stats = video->encoder_stats;
+    pthread_mutex_unlock(&video->progress_lock);
 
-#if NODE_VERSION_AT_LEAST(0,6,0)
-void
-#else
-int
-#endif
-AsyncStackedVideo::EIO_Encode(eio_req *req)
+    return scope.Close(encoder_stats_object(stats));
+}
+
+Handle<Value>
+AsyncStackedVideo::SetFrameRate(const Arguments &args)
 {
-    async_encode_request *enc_req = (async_encode_request *)req->data;
-    AsyncStackedVideo *video = (AsyncStackedVideo *)enc_req->video_obj;
+    HandleScope scope;
 
-    unsigned char *frame = (unsigned char *)malloc(sizeof(*frame)*video->width*video->height*3);
-    LOKI_ON_BLOCK_EXIT(free, frame);
-
-    for (size_t push_id = 0; push_id < video->push_id; push_id++) {
-        char fragment_path[512];
-        snprintf(fragment_path, 512, "%s/%d", video->tmp_dir.c_str(), push_id);
-        if (!is_dir(fragment_path)) {
-            char error[600];
-            snprintf(error, 600, "Error in AsyncStackedVideo::EIO_Encode %s is not a dir.",
-                fragment_path);
-            enc_req->error = strdup(error);
-            #if NODE_VERSION_AT_LEAST(0,6,0)
-            return;
-            #else
-            return 0;
-            #endif
-        }
+    if (args.Length() != 1) 
+        return VException("Two argument required - frame rate.");
 
-        char **fragments = find_files(fragment_path);
-        LOKI_ON_BLOCK_EXIT(free_file_list, fragments);
-        int nfragments = file_list_length(fragments);
+    if (!args[0]->IsInt32())
+        return VException("Frame rate must be integer.");
 
-        qsort(fragments, nfragments, sizeof(char *), fragment_sort);
+    int rate = args[0]->Int32Value();
 
-        if (!frame) {
-            enc_req->error = strdup("malloc failed in AsyncStackedVideo::EIO_Encode.");
-            #if NODE_VERSION_AT_LEAST(0,6,0)
-            return;
-            #else
-            return 0;
-            #endif
-        }
+    if (rate < 1)
+        return VException("Frame rate must be positive.");
 
-        for (int i = 0; i < nfragments; i++) {
-            snprintf(fragment_path, 512, "%s/%d/%s",
-                video->tmp_dir.c_str(), push_id, fragments[i]);
-            FILE *in = fopen(fragment_path, "r");
-            if (!in) {
-                char error[600];
-                snprintf(error, 600, "Failed opening %s in AsyncStackedVideo::EIO_Encode.",
-                    fragment_path);
-                enc_req->error = strdup(error);
-                #if NODE_VERSION_AT_LEAST(0,6,0)
-                return;
-                #else
-                return 0;
-                #endif
-            }
-            LOKI_ON_BLOCK_EXIT(fclose, in);
-            int size = file_size(fragment_path);
-            unsigned char *data = (unsigned char *)malloc(sizeof(*data)*size);
-            LOKI_ON_BLOCK_EXIT(free, data);
-            int read = fread(data, sizeof *data, size, in);
-            if (read != size) {
-                char error[600];
-                snprintf(error, 600, "Error - should have read %d but read only %d from %s in AsyncStackedVideo::EIO_Encode", size, read, fragment_path);
-                enc_req->error = strdup(error);
-                #if NODE_VERSION_AT_LEAST(0,6,0)
-                return;
-                #else
-                return 0;
-                #endif
-            }
-            Rect dims = rect_dims(fragments[i]);
-            push_fragment(frame, video->width, video->height,
-                data, dims.x, dims.y, dims.w, dims.h);
-        }
-        video->videoEncoder.newFrame(frame);
+    AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
+    try {
+        video->SetFrameRate(rate);
+    }
+    catch (const char *err) {
+        return VException(err);
     }
-    video->videoEncoder.end();
 
-    #if NODE_VERSION_AT_LEAST(0,6,0)
-    return;
-    #else
-    return 0;
-    #endif
+    return Undefined();
 }
 
-int
-AsyncStackedVideo::EIO_EncodeAfter(eio_req *req)
+Handle<Value>
+AsyncStackedVideo::SetKeyFrameInterval(const Arguments &args)
 {
     HandleScope scope;
 
-    ev_unref(EV_DEFAULT_UC);
-    async_encode_request *enc_req = (async_encode_request *)req->data;
+    if (args.Length() != 1) 
+        return VException("One argument required - keyframe interval.");
 
-    Handle<Value> argv[2];
+    if (!args[0]->IsInt32())
+        return VException("Keyframe interval must be integer.");
 
-    if (enc_req->error) {
-        argv[0] = False();
-        argv[1] = ErrorException(enc_req->error);
+    int interval = args[0]->Int32Value();
+
+    if (interval < 1)
+        return VException("Keyframe interval must be positive.");
+
+    AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
+    try {
+        video->SetKeyFrameInterval(interval);
     }
-    else {
-        argv[0] = True();
-        argv[1] = Undefined();
+    catch (const char *err) {
+        return VException(err);
     }
 
-    TryCatch try_catch; // don't quite see the necessity of this
+    return Undefined();
+}
 
-    enc_req->callback->Call(Context::GetCurrent()->Global(), 2, argv);
+Handle<Value>
+AsyncStackedVideo::SetMaxKeyFrameInterval(const Arguments &args)
+{
+    HandleScope scope;
 
-    if (try_catch.HasCaught())
-        FatalException(try_catch);
+    if (args.Length() != 1)
+        return VException("One argument required - max keyframe interval.");
+
+    if (!args[0]->IsInt32())
+        return VException("Max keyframe interval must be integer.");
+
+    int interval = args[0]->Int32Value();
+
+    if (interval < 0)
+        return VException("Max keyframe interval must be positive.");
+
+    AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
+    try {
+        video->SetMaxKeyFrameInterval(interval);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+
+    return Undefined();
+}
+
+Handle<Value>
+AsyncStackedVideo::SetSceneChangeThreshold(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - changed fraction of the frame.");
+
+    if (!args[0]->IsNumber())
+        return VException("Scene change threshold must be a number.");
+
+    double threshold = args[0]->NumberValue();
+
+    if (threshold < 0 || threshold > 1)
+        return VException("Scene change threshold must be between 0 and 1.");
+
+    AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
+    try {
+        video->SetSceneChangeThreshold(threshold);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+
+    return Undefined();
+}
+
+Handle<Value>
+AsyncStackedVideo::SetSegments(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1)
+        return VException("At least one argument required - segment options.");
+
+    if (args.Length() > 1 && !args[1]->IsFunction())
+        return VException("Second argument must be a function.");
+
+    double seconds;
+    unsigned long long bytes;
+    const char *error = limit_options_from_value(args[0], seconds, bytes);
+    if (error)
+        return VException(error);
+
+    AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
+    try {
+        video->SetSegments(seconds, bytes);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+
+    if (!video->segment_callback.IsEmpty()) {
+        video->segment_callback.Dispose();
+        video->segment_callback.Clear();
+    }
+    if (args.Length() > 1)
+        video->segment_callback = Persistent<Function>::New(Local<Function>::Cast(args[1]));
+
+    return Undefined();
+}
+
+Handle<Value>
+AsyncStackedVideo::SetCrop(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 4)
+        return VException("Four arguments required - x, y, width, height.");
+
+    if (!args[0]->IsInt32())
+        return VException("First argument must be integer x.");
+    if (!args[1]->IsInt32())
+        return VException("Second argument must be integer y.");
+    if (!args[2]->IsInt32())
+        return VException("Third argument must be integer width.");
+    if (!args[3]->IsInt32())
+        return VException("Fourth argument must be integer height.");
+
+    AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
+    int x = args[0]->Int32Value();
+    int y = args[1]->Int32Value();
+    int w = args[2]->Int32Value();
+    int h = args[3]->Int32Value();
+
+    if (x < 0)
+        return VException("Coordinate x smaller than 0.");
+    if (y < 0)
+        return VException("Coordinate y smaller than 0.");
+    if (w <= 0)
+        return VException("Width must be positive.");
+    if (h <= 0)
+        return VException("Height must be positive.");
+    if (x+w > video->width)
+        return VException("Crop rectangle exceeds AsyncStackedVideo's width.");
+    if (y+h > video->height)
+        return VException("Crop rectangle exceeds AsyncStackedVideo's height.");
+
+    try {
+        video->SetCrop(x, y, w, h);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+
+    return Undefined();
+}
+
+Handle<Value>
+AsyncStackedVideo::SetTmpDir(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - path to tmp dir.");
+
+    if (!args[0]->IsString())
+        return VException("First argument must be string.");
+
+    String::AsciiValue tmp_dir(args[0]->ToString());
+
+    AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
+    video->tmp_dir = *tmp_dir;
+
+    return Undefined();
+}
+
+Handle<Value>
+AsyncStackedVideo::SetMemoryLimit(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - memory limit in bytes.");
+
+    if (!args[0]->IsNumber())
+        return VException("Memory limit must be a number.");
+
+    int64_t limit = args[0]->IntegerValue();
+
+    if (limit < 0)
+        return VException("Memory limit can't be negative.");
+
+    AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
+    video->SetMemoryLimit(limit);
+
+    return Undefined();
+}
+
+Handle<Value>
+AsyncStackedVideo::SetIncrementalEncoding(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - true or false.");
+
+    if (!args[0]->IsBoolean())
+        return VException("First argument must be boolean.");
+
+    AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
+    if (args[0]->BooleanValue() && video->two_pass)
+        return VException("Incremental encoding can't be combined with two pass encoding.");
+    if (video->ended)
+        return VException("Incremental encoding can't be changed after encode was called.");
+
+    video->SetIncrementalEncoding(args[0]->BooleanValue());
+
+    return Undefined();
+}
+
+Handle<Value>
+AsyncStackedVideo::SetFragmentCompression(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - true or false.");
+
+    if (!args[0]->IsBoolean())
+        return VException("First argument must be boolean.");
+
+    AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
+    video->SetFragmentCompression(args[0]->BooleanValue());
+
+    return Undefined();
+}
+
+Handle<Value>
+AsyncStackedVideo::SetTwoPass(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - true or false.");
+
+    if (!args[0]->IsBoolean())
+        return VException("First argument must be boolean.");
+
+    AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
+    if (args[0]->BooleanValue() && video->incremental)
+        return VException("Two pass encoding can't be combined with incremental encoding.");
+    if (video->ended)
+        return VException("Two pass encoding can't be changed after encode was called.");
+
+    video->SetTwoPass(args[0]->BooleanValue());
+
+    return Undefined();
+}
+
+void
+AsyncStackedVideo::push_fragment(unsigned char *frame, int width, int height,
+    const unsigned char *fragment, int x, int y, int w, int h)
+{
+    int start = y*width*3 + x*3;
+
+    for (int i = 0; i < h; i++) {
+        unsigned char *framep = &frame[start + i*width*3];
+        for (int j = 0; j < w; j++) {
+            *framep++ = *fragment++;
+            *framep++ = *fragment++;
+            *framep++ = *fragment++;
+        }
+    }
+}
+
+bool
+AsyncStackedVideo::Aborted()
+{
+    pthread_mutex_lock(&progress_lock);
+    bool ret = aborted;
+    pthread_mutex_unlock(&progress_lock);
+    return ret;
+}
+
+// Accounts a frame that was just encoded and wakes up the main thread to
+// report progress, at most once every PROGRESS_INTERVAL seconds.
+void
+AsyncStackedVideo::FrameEncoded(double composite, double encode)
+{
+    double now = wall_time();
+
+    pthread_mutex_lock(&progress_lock);
+    frames_encoded++;
+    encoder_stats = videoEncoder.getStats();
+    videoEncoder.takeClosedSegments(closed_segments);
+    composite_time += composite;
+    encode_time += encode;
+    bool report = progress_active && now - last_progress >= PROGRESS_INTERVAL;
+    if (report)
+        last_progress = now;
+    pthread_mutex_unlock(&progress_lock);
+
+    if (report)
+        uv_async_send(&progress_async);
+}
+
+// The encoder belongs to the work thread while an encode step or the final
+// encode runs. Settings made meanwhile are queued and applied between steps.
+// Once the final encode runs, there's no step left to apply them before.
+void
+AsyncStackedVideo::ChangeSetting(const EncoderSetting &setting)
+{
+    if (!encoding) {
+        ApplySetting(setting);
+        return;
+    }
+    if (ended && !final_req)
+        throw "Encoder settings can't be changed while encode is running.";
+    pending_settings.push_back(setting);
+}
+
+void
+AsyncStackedVideo::ApplySetting(const EncoderSetting &setting)
+{
+    const int *v = setting.value;
+    switch (setting.kind) {
+    case EncoderSetting::QUALITY: videoEncoder.setQuality(v[0]); break;
+    case EncoderSetting::BITRATE: videoEncoder.setBitrate(v[0], v[1], v[2]); break;
+    case EncoderSetting::SPEED: videoEncoder.setSpeed(v[0]); break;
+    case EncoderSetting::AUTO_SPEED: videoEncoder.setAutoSpeed(v[0]); break;
+    case EncoderSetting::GOVERNOR: videoEncoder.setGovernor(v[0]); break;
+    case EncoderSetting::FRAME_RATE: videoEncoder.setFrameRate(v[0]); break;
+    case EncoderSetting::KEYFRAME_INTERVAL: videoEncoder.setKeyFrameInterval(v[0]); break;
+    case EncoderSetting::MAX_KEYFRAME_INTERVAL: videoEncoder.setMaxKeyFrameInterval(v[0]); break;
+    case EncoderSetting::SCENE_CHANGE_THRESHOLD:
+        videoEncoder.setSceneChangeThreshold(setting.threshold);
+        break;
+    }
+}
+
+// A queued setting the encoder refuses fails the encode, like an encoder
+// error in the step would have.
+void
+AsyncStackedVideo::ApplyPendingSettings()
+{
+    for (size_t i = 0; i < pending_settings.size(); i++) {
+        try {
+            ApplySetting(pending_settings[i]);
+        }
+        catch (const char *err) {
+            if (!encode_error)
+                encode_error = strdup(err);
+        }
+    }
+    pending_settings.clear();
+}
+
+// Picks up segments the encoder finished, on a work thread.
+void
+AsyncStackedVideo::CollectSegments()
+{
+    pthread_mutex_lock(&progress_lock);
+    videoEncoder.takeClosedSegments(closed_segments);
+    pthread_mutex_unlock(&progress_lock);
+}
+
+// Tells the segment callback about the segments collected so far, on the
+// main thread.
+void
+AsyncStackedVideo::NotifySegments()
+{
+    std::vector<SegmentInfo> segments;
+    pthread_mutex_lock(&progress_lock);
+    segments.swap(closed_segments);
+    pthread_mutex_unlock(&progress_lock);
+
+    if (!segment_callback.IsEmpty())
+        call_segment_callback(segment_callback, segments);
+}
+
+// Fraction of the frame covered by batch's fragments. Overlapping fragments
+// are counted twice, which is close enough for keyframe placement.
+double
+AsyncStackedVideo::changed_fraction(const FrameBatch *batch, int width, int height)
+{
+    if (width == 0 || height == 0)
+        return 1;
+
+    double area = 0;
+    for (size_t i = 0; i < batch->fragments.size(); i++)
+        area += (double)batch->fragments[i].w*batch->fragments[i].h;
+
+    double fraction = area/((double)width*height);
+    return fraction > 1 ? 1 : fraction;
+}
+
+// Stacks all fragments of batch onto frame. Fragments are either still in
+// memory or in the journal, possibly compressed.
+void
+AsyncStackedVideo::composite_frame(unsigned char *frame, int width, int height,
+    const FrameBatch *batch, JournalMapping &journal,
+    std::vector<unsigned char> &unpacked)
+{
+    const std::vector<FragmentEntry> &fragments = batch->fragments;
+
+    for (size_t j = 0; j < fragments.size(); j++) {
+        const FragmentEntry &fragment = fragments[j];
+        if (fragment.data) {
+            push_fragment(frame, width, height, fragment.data,
+                fragment.x, fragment.y, fragment.w, fragment.h);
+            continue;
+        }
+        const unsigned char *data = journal.data(fragment.offset);
+        if (fragment.codec == FragmentRecord::CODEC_RLE) {
+            unpacked.resize(fragment.length);
+            if (!rle_decode(data, fragment.stored_length,
+                fragment.w, fragment.h, &unpacked[0]))
+            {
+                throw "Corrupt fragment in journal in AsyncStackedVideo::composite_frame.";
+            }
+            data = &unpacked[0];
+        }
+        push_fragment(frame, width, height, data,
+            fragment.x, fragment.y, fragment.w, fragment.h);
+        journal.consumed(fragment.offset);
+    }
+}
+
+// Composites and encodes frames, then frees them unless keep is set. Returns
+// NULL or malloced error message. Called on work threads only, one at a time.
+// After abort() frames are only freed.
+char *
+AsyncStackedVideo::EncodeFrames(std::vector<FrameBatch *> &frames, off_t journal_size,
+    bool keep)
+{
+    char *error = NULL;
+
+    bool need_journal = false;
+    for (size_t i = 0; i < frames.size(); i++)
+        if (frames[i]->state == FrameBatch::JOURNAL) need_journal = true;
+
+    JournalMapping journal;
+    std::vector<unsigned char> unpacked;
+
+    if (!frame)
+        frame = (unsigned char *)calloc(width*height*3, 1);
+
+    if (!frame) {
+        error = strdup("malloc failed in AsyncStackedVideo::EncodeFrames.");
+    }
+    else if (need_journal && !journal.open(store.journalPath(), journal_size)) {
+        char msg[600];
+        snprintf(msg, 600, "Failed mapping %s in AsyncStackedVideo::EncodeFrames. "
+            "Error: %s.", store.journalPath(), strerror(errno));
+        error = strdup(msg);
+    }
+    else {
+        try {
+            for (size_t i = 0; i < frames.size() && !Aborted(); i++) {
+                unsigned long timestamp = frames[i]->timestamp;
+                if (last_timestamp != 0 && timestamp > 0)
+                    videoEncoder.dupFrame(frame, timestamp - last_timestamp);
+
+                double t0 = wall_time();
+                composite_frame(frame, width, height, frames[i], journal, unpacked);
+                double t1 = wall_time();
+                videoEncoder.frameChanged(changed_fraction(frames[i], width, height));
+                videoEncoder.newFrame(frame);
+                FrameEncoded(t1 - t0, wall_time() - t1);
+                last_timestamp = timestamp;
+            }
+        }
+        catch (const char *err) {
+            error = strdup(err);
+        }
+    }
+
+    if (!keep)
+        DiscardFrames(frames);
+
+    return error;
+}
+
+void
+AsyncStackedVideo::DiscardFrames(std::vector<FrameBatch *> &frames)
+{
+    for (size_t i = 0; i < frames.size(); i++)
+        store.discard(frames[i], incremental);
+    frames.clear();
+}
+
+// Replays frames through the encoder once to gather its rate control metrics,
+// then gets everything ready to replay them again for the second pass that
+// writes the video. The first pass writes nothing and runs at the encoder's
+// fastest speed level, so it costs much less than the second.
+char *
+AsyncStackedVideo::FirstPass(std::vector<FrameBatch *> &frames, off_t journal_size)
+{
+    videoEncoder.setPass(1);
+    char *error = EncodeFrames(frames, journal_size, true);
+
+    try {
+        videoEncoder.reset();
+    }
+    catch (const char *err) {
+        if (!error) error = strdup(err);
+    }
+
+    if (!error && Aborted())
+        error = strdup("Encoding was aborted during the first pass, no video was written.");
+
+    videoEncoder.setPass(2);
+    if (frame)
+        memset(frame, 0, width*height*3);
+    last_timestamp = 0;
+
+    pthread_mutex_lock(&progress_lock);
+    pass = 2;
+    frames_encoded = 0;
+    frames_at_start = 0;
+    pass_started = wall_time();
+    pthread_mutex_unlock(&progress_lock);
+
+    return error;
+}
+
+void
+AsyncStackedVideo::ScheduleEncode()
+{
+    if (encoding || !store.hasReadyFrames())
+        return;
+
+    encoding = true;
+    step_work.data = this;
+    uv_queue_work(uv_default_loop(), &step_work, UV_EncodeStep, UV_EncodeStepAfter);
+    Ref();
+}
+
+void
+AsyncStackedVideo::UV_EncodeStep(uv_work_t *req)
+{
+    AsyncStackedVideo *video = (AsyncStackedVideo *)req->data;
+
+    std::vector<FrameBatch *> frames;
+    off_t journal_size = video->store.takeFrames(frames);
+
+    char *error = video->EncodeFrames(frames, journal_size);
+    if (error && !video->encode_error)
+        video->encode_error = error;
+    else
+        free(error);
+}
+
+void
+AsyncStackedVideo::UV_EncodeStepAfter(AFTER_WORK_ARGS)
+{
+    AsyncStackedVideo *video = (AsyncStackedVideo *)req->data;
+    video->encoding = false;
+    video->ApplyPendingSettings();
+    video->NotifySegments();
+
+    if (video->final_req)
+        video->FinishEncode();
+    else
+        video->ScheduleEncode();
+    video->Unref();
+}
+
+// Starts the final encode once encode() was called and no write or encode
+// step is in flight, instead of blocking a thread pool thread waiting on them.
+void
+AsyncStackedVideo::FinishEncode()
+{
+    if (!final_req || writing || encoding)
+        return;
+
+    // encoding stays set during the final encode so no more steps get started
+    encoding = true;
+    final_req->work.data = final_req;
+    uv_queue_work(uv_default_loop(), &final_req->work, UV_Encode, UV_EncodeAfter);
+    final_req = NULL;
+}
+
+void
+AsyncStackedVideo::UV_Encode(uv_work_t *req)
+{
+    async_encode_request *enc_req = (async_encode_request *)req->data;
+    AsyncStackedVideo *video = (AsyncStackedVideo *)enc_req->video_obj;
+
+    std::vector<FrameBatch *> frames;
+    off_t journal_size = video->store.takeFrames(frames);
+
+    char *error = NULL;
+    if (video->two_pass)
+        error = video->FirstPass(frames, journal_size);
+
+    if (error)
+        video->DiscardFrames(frames);
+    else
+        error = video->EncodeFrames(frames, journal_size);
+
+    try {
+        video->videoEncoder.end();
+    }
+    catch (const char *err) {
+        if (!error) error = strdup(err);
+    }
+    video->CollectSegments();
+
+    // an error from an earlier incremental step wins, it happened first
+    if (video->encode_error) {
+        free(error);
+        error = video->encode_error;
+        video->encode_error = NULL;
+    }
+    enc_req->error = error;
+}
+
+void
+AsyncStackedVideo::UV_EncodeAfter(AFTER_WORK_ARGS)
+{
+    HandleScope scope;
+
+    async_encode_request *enc_req = (async_encode_request *)req->data;
+    AsyncStackedVideo *video = enc_req->video_obj;
+
+    video->NotifySegments();
+
+    if (video->progress_active) {
+        video->progress_active = false;
+        video->progress_callback.Dispose();
+        video->progress_callback.Clear();
+        // the handle is a member, so keep the video around until it's closed
+        video->Ref();
+        uv_close((uv_handle_t *)&video->progress_async, UV_ProgressClosed);
+    }
+
+    // the work thread is done, no need to lock progress_lock anymore
+    Local<Object> stats = encoder_stats_object(video->encoder_stats);
+    stats->Set(String::New("frames"), Integer::New(video->frames_encoded));
+    stats->Set(String::New("aborted"), Boolean::New(video->aborted));
+    stats->Set(String::New("compositeTime"), Number::New(video->composite_time*1000));
+    stats->Set(String::New("encodeTime"), Number::New(video->encode_time*1000));
+    stats->Set(String::New("totalTime"),
+        Number::New((wall_time() - video->encode_started)*1000));
+
+    Handle<Value> argv[3];
+
+    if (enc_req->error) {
+        argv[0] = False();
+        argv[1] = ErrorException(enc_req->error);
+    }
+    else {
+        argv[0] = True();
+        argv[1] = Undefined();
+    }
+    argv[2] = stats;
+
+    TryCatch try_catch; // don't quite see the necessity of this
+
+    enc_req->callback->Call(Context::GetCurrent()->Global(), 3, argv);
+
+    if (try_catch.HasCaught())
+        FatalException(try_catch);
 
     enc_req->callback.Dispose();
+    free(enc_req->error);
 
     enc_req->video_obj->Unref();
     free(enc_req);
-
-    return 0;
 }
 
 
@@ -533,15 +1337,28 @@ AsyncStackedVideo::Encode(const Arguments &args)
 {
     HandleScope scope;
 
-    if (args.Length() != 1)
-        return VException("One argument required - callback function.");
+    if (args.Length() < 1)
+        return VException("At least one argument required - callback function.");
 
     if (!args[0]->IsFunction())
         return VException("First argument must be a function.");
 
+    if (args.Length() > 1 && !args[1]->IsFunction())
+        return VException("Second argument must be a function.");
+
     Local<Function> callback = Local<Function>::Cast(args[0]);
     AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
 
+    if (video->ended)
+        return VException("encode was already called.");
+
+    if (video->two_pass) {
+        int bitrate, bufferDelay, flags;
+        video->videoEncoder.getBitrate(bitrate, bufferDelay, flags);
+        if (bitrate <= 0)
+            return VException("Two pass encoding needs a bitrate. Use setBitrate to set it.");
+    }
+
     async_encode_request *enc_req = (async_encode_request *)malloc(sizeof(*enc_req));
     if (!enc_req)
         return VException("malloc in AsyncStackedVideo::Encode failed.");
@@ -550,10 +1367,219 @@ AsyncStackedVideo::Encode(const Arguments &args)
     enc_req->video_obj = video;
     enc_req->error = NULL;
 
-    eio_custom(EIO_Encode, EIO_PRI_DEFAULT, EIO_EncodeAfter, enc_req);
-
-    ev_ref(EV_DEFAULT_UC);
     video->Ref();
+    video->ended = true;
+
+    pthread_mutex_lock(&video->progress_lock);
+    video->encode_started = wall_time();
+    video->pass_started = video->encode_started;
+    video->frames_at_start = video->frames_encoded;
+    if (args.Length() > 1) {
+        video->progress_callback = Persistent<Function>::New(Local<Function>::Cast(args[1]));
+        uv_async_init(uv_default_loop(), &video->progress_async, UV_Progress);
+        video->progress_async.data = video;
+        video->progress_active = true;
+    }
+    pthread_mutex_unlock(&video->progress_lock);
+
+    video->final_req = enc_req;
+    video->FinishEncode();
+
+    return Undefined();
+}
+
+void
+AsyncStackedVideo::UV_Progress(ASYNC_CB_ARGS)
+{
+    HandleScope scope;
+
+    AsyncStackedVideo *video = (AsyncStackedVideo *)handle->data;
+    if (!video->progress_active)
+        return;
+
+    video->NotifySegments();
+
+    pthread_mutex_lock(&video->progress_lock);
+    unsigned int done = video->frames_encoded;
+    EncoderStats stats = video->encoder_stats;
+    int pass = video->pass;
+    double pass_started = video->pass_started;
+    unsigned int frames_at_start = video->frames_at_start;
+    pthread_mutex_unlock(&video->progress_lock);
+
+    // with two passes the eta is of the running pass
+    unsigned int total = video->push_id;
+    unsigned int done_now = done - frames_at_start;
+    double elapsed = wall_time() - pass_started;
+    double eta = done_now > 0 && total > done ?
+        elapsed/done_now*(total - done) : 0;
+
+    Local<Object> progress = Object::New();
+    progress->Set(String::New("framesDone"), Integer::New(done));
+    progress->Set(String::New("framesTotal"), Integer::New(total));
+    progress->Set(String::New("bytesWritten"), Number::New(stats.bytesWritten));
+    progress->Set(String::New("degradation"), Integer::New(stats.degradation));
+    progress->Set(String::New("eta"), Number::New(eta));
+    progress->Set(String::New("pass"), Integer::New(pass));
+    progress->Set(String::New("passes"), Integer::New(video->two_pass ? 2 : 1));
+
+    Handle<Value> argv[1] = { progress };
+
+    TryCatch try_catch;
+
+    video->progress_callback->Call(Context::GetCurrent()->Global(), 1, argv);
+
+    if (try_catch.HasCaught())
+        FatalException(try_catch);
+}
+
+void
+AsyncStackedVideo::UV_ProgressClosed(uv_handle_t *handle)
+{
+    AsyncStackedVideo *video = (AsyncStackedVideo *)handle->data;
+    video->Unref();
+}
+
+void
+AsyncStackedVideo::UV_Recover(uv_work_t *req)
+{
+    recover_request *rec_req = (recover_request *)req->data;
+
+    StoreHeader header;
+    std::vector<FrameBatch *> frames;
+    off_t journal_size;
+
+    if (!FragmentStore::load(rec_req->tmp_dir, header, frames, journal_size)) {
+        char msg[600];
+        snprintf(msg, 600, "No fragment store found in %s.", rec_req->tmp_dir);
+        rec_req->error = strdup(msg);
+        return;
+    }
+
+    std::string journal_path = std::string(rec_req->tmp_dir) + "/fragments.journal";
+    JournalMapping journal;
+    std::vector<unsigned char> unpacked;
+    // load keeps width and height within MAX_DIMENSION, so this can't overflow
+    size_t frame_size = (size_t)header.width*header.height*3;
+    unsigned char *frame = (unsigned char *)calloc(frame_size, 1);
+
+    try {
+        if (!frame)
+            throw "malloc failed in AsyncStackedVideo::UV_Recover.";
+        if (!journal.open(journal_path.c_str(), journal_size))
+            throw "Failed mapping fragment journal in AsyncStackedVideo::UV_Recover.";
+
+        VideoEncoder encoder(header.width, header.height);
+        encoder.setOutputFile(rec_req->out_file);
+        encoder.setQuality(header.quality);
+        encoder.setFrameRate(header.frame_rate);
+        encoder.setKeyFrameInterval(header.keyframe_interval);
+        encoder.setCrop(header.crop_x, header.crop_y, header.crop_w, header.crop_h);
+        encoder.setBitrate(header.bitrate, header.rate_buffer, header.rate_flags);
+
+        unsigned long last_timestamp = 0;
+        for (size_t i = 0; i < frames.size(); i++) {
+            unsigned long timestamp = frames[i]->timestamp;
+            if (last_timestamp != 0 && timestamp > 0)
+                encoder.dupFrame(frame, timestamp - last_timestamp);
+
+            composite_frame(frame, header.width, header.height, frames[i],
+                journal, unpacked);
+            encoder.newFrame(frame);
+            last_timestamp = timestamp;
+            rec_req->frames++;
+        }
+        encoder.end();
+    }
+    catch (const char *err) {
+        rec_req->error = strdup(err);
+    }
+
+    free(frame);
+    for (size_t i = 0; i < frames.size(); i++)
+        delete frames[i];
+}
+
+void
+AsyncStackedVideo::UV_RecoverAfter(AFTER_WORK_ARGS)
+{
+    HandleScope scope;
+
+    recover_request *rec_req = (recover_request *)req->data;
+
+    Local<Object> stats = Object::New();
+    stats->Set(String::New("frames"), Integer::New(rec_req->frames));
+
+    Handle<Value> argv[3];
+
+    if (rec_req->error) {
+        argv[0] = False();
+        argv[1] = ErrorException(rec_req->error);
+    }
+    else {
+        argv[0] = True();
+        argv[1] = Undefined();
+    }
+    argv[2] = stats;
+
+    TryCatch try_catch;
+
+    rec_req->callback->Call(Context::GetCurrent()->Global(), 3, argv);
+
+    if (try_catch.HasCaught())
+        FatalException(try_catch);
+
+    rec_req->callback.Dispose();
+    free(rec_req->tmp_dir);
+    free(rec_req->out_file);
+    free(rec_req->error);
+    free(rec_req);
+}
+
+Handle<Value>
+AsyncStackedVideo::Recover(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 3)
+        return VException("Three arguments required - tmp dir, output file and callback function.");
+
+    if (!args[0]->IsString())
+        return VException("First argument must be tmp dir.");
+
+    if (!args[1]->IsString())
+        return VException("Second argument must be output file name.");
+
+    if (!args[2]->IsFunction())
+        return VException("Third argument must be a function.");
+
+    String::AsciiValue tmpDir(args[0]->ToString());
+    String::AsciiValue outFile(args[1]->ToString());
+    Local<Function> callback = Local<Function>::Cast(args[2]);
+
+    recover_request *rec_req = (recover_request *)malloc(sizeof(*rec_req));
+    if (!rec_req)
+        return VException("malloc in AsyncStackedVideo::Recover failed.");
+
+    rec_req->callback = Persistent<Function>::New(callback);
+    rec_req->tmp_dir = strdup(*tmpDir);
+    rec_req->out_file = strdup(*outFile);
+    rec_req->error = NULL;
+    rec_req->frames = 0;
+    rec_req->work.data = rec_req;
+
+    uv_queue_work(uv_default_loop(), &rec_req->work, UV_Recover, UV_RecoverAfter);
+
+    return Undefined();
+}
+
+Handle<Value>
+AsyncStackedVideo::Abort(const Arguments &args)
+{
+    HandleScope scope;
+
+    AsyncStackedVideo *video = ObjectWrap::Unwrap<AsyncStackedVideo>(args.This());
+    video->Abort();
 
     return Undefined();
 }
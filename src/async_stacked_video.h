@@ -3,32 +3,45 @@
 
 #include <vector>
 #include <string>
+#include <pthread.h>
 #include <node.h>
 #include <node_version.h>
+#include "common.h"
 #include "video_encoder.h"
+#include "fragment_store.h"
 
-struct push_request {
-    unsigned int push_id;
-    unsigned int fragment_id;
-    const char *tmp_dir;
-    unsigned char *data;
-    int data_size;
-    int x, y, w, h;
+class AsyncStackedVideo;
+
+struct write_request {
+    uv_work_t work;
+    AsyncStackedVideo *video_obj;
+    WriteBatch *batch;
 };
 
-class AsyncStackedVideo;
+struct recover_request {
+    uv_work_t work;
+    v8::Persistent<v8::Function> callback;
+    char *tmp_dir, *out_file;
+    char *error;
+    unsigned int frames;
+};
 
 struct async_encode_request {
+    uv_work_t work;
     AsyncStackedVideo *video_obj;
     v8::Persistent<v8::Function> callback;
     char *error;
 };
 
-struct Rect {
-    int x, y, w, h;
-    Rect() {}
-    Rect(int xx, int yy, int ww, int hh) : x(xx), y(yy), w(ww), h(hh) {}
-    bool isNull() { return x == 0 && y == 0 && w == 0 && h == 0; }
+// An encoder setting made while the encoder was busy on a work thread,
+// applied once the encode step is done.
+struct EncoderSetting {
+    enum Kind {
+        QUALITY, BITRATE, SPEED, AUTO_SPEED, GOVERNOR, FRAME_RATE,
+        KEYFRAME_INTERVAL, MAX_KEYFRAME_INTERVAL, SCENE_CHANGE_THRESHOLD
+    } kind;
+    int value[3];
+    double threshold;
 };
 
 class AsyncStackedVideo : public node::ObjectWrap {
@@ -37,42 +50,118 @@ class AsyncStackedVideo : public node::ObjectWrap {
     VideoEncoder videoEncoder;
 
     std::string tmp_dir;
+    FragmentStore store;
     unsigned int push_id, fragment_id;
 
-#if NODE_VERSION_AT_LEAST(0,6,0)
-    static void EIO_Push(eio_req *req);
-    static void EIO_Encode(eio_req *req);
-#else
-    static int EIO_Push(eio_req *req);
-    static int EIO_Encode(eio_req *req);
-#endif
-    static int EIO_PushAfter(eio_req *req);
-    static int EIO_EncodeAfter(eio_req *req);
+    bool writing; // a write job is in flight
+    bool incremental, encoding;
+    bool two_pass;
+    uv_work_t step_work; // of the running incremental encode step
+    unsigned char *frame; // frame being composited, kept between encode steps
+    unsigned long last_timestamp; // of the last encoded frame
+    char *encode_error;
+    async_encode_request *final_req; // encode() waiting for writes and steps to finish
+    bool ended; // encode() was called
+    std::vector<EncoderSetting> pending_settings; // made during an encode step
+
+    // progress of encoding, updated by work threads under progress_lock
+    pthread_mutex_t progress_lock;
+    uv_async_t progress_async;
+    v8::Persistent<v8::Function> progress_callback;
+    bool progress_active, aborted;
+    unsigned int frames_encoded, frames_at_start;
+    int pass; // 1 or 2 while encoding
+    EncoderStats encoder_stats; // snapshot after the last encoded frame
+    double encode_started, pass_started, last_progress;
+    double composite_time, encode_time;
+    std::vector<SegmentInfo> closed_segments; // not yet told to segment_callback
+    v8::Persistent<v8::Function> segment_callback;
+
+    static void UV_Write(uv_work_t *req);
+    static void UV_EncodeStep(uv_work_t *req);
+    static void UV_Encode(uv_work_t *req);
+    static void UV_WriteAfter(AFTER_WORK_ARGS);
+    static void UV_EncodeStepAfter(AFTER_WORK_ARGS);
+    static void UV_EncodeAfter(AFTER_WORK_ARGS);
+    static void UV_Progress(ASYNC_CB_ARGS);
+    static void UV_ProgressClosed(uv_handle_t *handle);
+    static void UV_Recover(uv_work_t *req);
+    static void UV_RecoverAfter(AFTER_WORK_ARGS);
+
+    void Spill();
+    void StartWriter();
+    void FinishEncode();
+    void ScheduleEncode();
+    char *EncodeFrames(std::vector<FrameBatch *> &frames, off_t journal_size,
+        bool keep=false);
+    char *FirstPass(std::vector<FrameBatch *> &frames, off_t journal_size);
+    void DiscardFrames(std::vector<FrameBatch *> &frames);
+    bool Aborted();
+    void FrameEncoded(double composite, double encode);
+    void ChangeSetting(const EncoderSetting &setting);
+    void ApplySetting(const EncoderSetting &setting);
+    void ApplyPendingSettings();
+    void CollectSegments();
+    void NotifySegments();
 
     static void push_fragment(unsigned char *frame, int width, int height,
-        unsigned char *fragment, int x, int y, int w, int h);
-    static Rect rect_dims(const char *fragment_name);
+        const unsigned char *fragment, int x, int y, int w, int h);
+    static double changed_fraction(const FrameBatch *batch, int width, int height);
+    static void composite_frame(unsigned char *frame, int width, int height,
+        const FrameBatch *batch, JournalMapping &journal,
+        std::vector<unsigned char> &unpacked);
 
 public:
     AsyncStackedVideo(int wwidth, int hheight);
+    ~AsyncStackedVideo();
     static void Initialize(v8::Handle<v8::Object> target);
     v8::Handle<v8::Value> Push(unsigned char *rect, int x, int y, int w, int h);
+    void PushMany(unsigned char *buf, const RectList &rects);
     void EndPush(unsigned long timeStamp=0);
     void SetOutputFile(const char *fileName);
     void SetQuality(int quality);
+    void SetBitrate(int bitrate, int bufferDelay, int flags);
+    void SetSpeed(int speed);
+    void SetAutoSpeed(bool enabled);
+    void SetGovernor(bool enabled);
     void SetFrameRate(int frameRate);
     void SetKeyFrameInterval(int keyFrameInterval);
+    void SetMaxKeyFrameInterval(int interval);
+    void SetSceneChangeThreshold(double threshold);
+    void SetCrop(int x, int y, int w, int h);
+    void SetSegments(double seconds, unsigned long long bytes);
+    void SetMemoryLimit(size_t limit);
+    void SetIncrementalEncoding(bool enabled);
+    void SetFragmentCompression(bool enabled);
+    void SetTwoPass(bool enabled);
+    void Abort();
 
 protected:
     static v8::Handle<v8::Value> New(const v8::Arguments &args);
     static v8::Handle<v8::Value> Push(const v8::Arguments &args);
+    static v8::Handle<v8::Value> PushMany(const v8::Arguments &args);
     static v8::Handle<v8::Value> EndPush(const v8::Arguments &args);
     static v8::Handle<v8::Value> SetOutputFile(const v8::Arguments &args);
     static v8::Handle<v8::Value> SetQuality(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetBitrate(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetSpeed(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetAutoSpeed(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetGovernor(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Stats(const v8::Arguments &args);
     static v8::Handle<v8::Value> SetFrameRate(const v8::Arguments &args);
     static v8::Handle<v8::Value> SetKeyFrameInterval(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetMaxKeyFrameInterval(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetSceneChangeThreshold(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetCrop(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetSegments(const v8::Arguments &args);
     static v8::Handle<v8::Value> SetTmpDir(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetMemoryLimit(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetIncrementalEncoding(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetFragmentCompression(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetTwoPass(const v8::Arguments &args);
     static v8::Handle<v8::Value> Encode(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Abort(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Recover(const v8::Arguments &args);
 };
 
 #endif
@@ -0,0 +1,49 @@
+#include <cstring>
+#include "change_map.h"
+
+ChangeMap::ChangeMap(int width, int height) :
+    blocksWidth((width + BLOCK_SIZE - 1)/BLOCK_SIZE),
+    blocksHeight((height + BLOCK_SIZE - 1)/BLOCK_SIZE),
+    blocks(blocksWidth*blocksHeight, 0) {}
+
+void
+ChangeMap::clear()
+{
+    if (!blocks.empty())
+        memset(&blocks[0], 0, blocks.size());
+}
+
+void
+ChangeMap::markAll()
+{
+    if (!blocks.empty())
+        memset(&blocks[0], 1, blocks.size());
+}
+
+void
+ChangeMap::mark(int x, int y, int w, int h)
+{
+    if (w <= 0 || h <= 0)
+        return;
+
+    int bx1 = x/BLOCK_SIZE;
+    int by1 = y/BLOCK_SIZE;
+    int bx2 = (x + w - 1)/BLOCK_SIZE;
+    int by2 = (y + h - 1)/BLOCK_SIZE;
+
+    if (bx2 >= blocksWidth) bx2 = blocksWidth - 1;
+    if (by2 >= blocksHeight) by2 = blocksHeight - 1;
+
+    for (int by = by1; by <= by2; by++)
+        memset(&blocks[by*blocksWidth + bx1], 1, bx2 - bx1 + 1);
+}
+
+int
+ChangeMap::changedBlocks() const
+{
+    int changed = 0;
+    for (size_t i = 0; i < blocks.size(); i++)
+        changed += blocks[i];
+    return changed;
+}
+
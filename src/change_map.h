@@ -0,0 +1,30 @@
+#ifndef CHANGE_MAP_H
+#define CHANGE_MAP_H
+
+#include <cstddef>
+#include <vector>
+
+// Keeps track of which 16x16 blocks (Theora macroblocks) of a frame changed.
+// One byte per block, row major, 1 = changed, 0 = unchanged.
+class ChangeMap {
+    int blocksWidth, blocksHeight;
+    std::vector<unsigned char> blocks;
+
+public:
+    static const int BLOCK_SIZE = 16;
+
+    ChangeMap(int width, int height);
+
+    void clear();
+    void markAll();
+    void mark(int x, int y, int w, int h);
+
+    int width() const { return blocksWidth; }
+    int height() const { return blocksHeight; }
+    int size() const { return blocks.size(); }
+    int changedBlocks() const;
+    const unsigned char *data() const { return blocks.empty() ? NULL : &blocks[0]; }
+};
+
+#endif
+
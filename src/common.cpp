@@ -1,8 +1,13 @@
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
 #include <cassert>
+#include <node_buffer.h>
+#include <node_version.h>
 #include "common.h"
 
 using namespace v8;
+using namespace node;
 
 Handle<Value>
 ErrorException(const char *msg)
@@ -22,3 +27,86 @@ bool str_eq(const char *s1, const char *s2)
         return strcmp(s1, s2) == 0;
 }
 
+
+bool
+rect_list_from_value(Handle<Value> value, RectList &list)
+{
+    list.rects = NULL;
+    list.count = 0;
+
+    if (value->IsArray()) {
+        Local<Array> array = Local<Array>::Cast(value);
+        list.storage.resize(array->Length());
+        for (uint32_t i = 0; i < array->Length(); i++)
+            list.storage[i] = array->Get(i)->Int32Value();
+        list.rects = list.storage.empty() ? NULL : &list.storage[0];
+        list.count = list.storage.size()/5;
+        return list.storage.size() % 5 == 0;
+    }
+
+    if (!value->IsObject())
+        return false;
+
+    Local<Object> obj = value->ToObject();
+
+    if (Buffer::HasInstance(obj)) {
+#if NODE_VERSION_AT_LEAST(0,3,0)
+        const char *data = Buffer::Data(obj);
+        size_t len = Buffer::Length(obj);
+#else
+        Buffer *buf = ObjectWrap::Unwrap<Buffer>(obj);
+        const char *data = buf->data();
+        size_t len = buf->length();
+#endif
+        // Buffers may be slices at any byte offset, so copy the values out
+        // rather than reading them through a possibly misaligned pointer.
+        list.storage.resize(len/sizeof(int32_t));
+        for (size_t i = 0; i < list.storage.size(); i++)
+            memcpy(&list.storage[i], data + i*sizeof(int32_t), sizeof(int32_t));
+        list.rects = list.storage.empty() ? NULL : &list.storage[0];
+        list.count = len/(5*sizeof(int32_t));
+        return len % (5*sizeof(int32_t)) == 0;
+    }
+
+    if (!obj->HasIndexedPropertiesInExternalArrayData())
+        return false;
+
+    ExternalArrayType type = obj->GetIndexedPropertiesExternalArrayDataType();
+    if (type != kExternalIntArray && type != kExternalUnsignedIntArray)
+        return false;
+
+    int len = obj->GetIndexedPropertiesExternalArrayDataLength();
+    list.rects = (const int32_t *)obj->GetIndexedPropertiesExternalArrayData();
+    list.count = len/5;
+    return len % 5 == 0;
+}
+
+bool
+check_rect_list(const RectList &list, size_t buf_len, int width, int height,
+    char *error, size_t error_len)
+{
+    const int32_t *r = list.rects;
+    for (int i = 0; i < list.count; i++, r += 5) {
+        int32_t x = r[0], y = r[1], w = r[2], h = r[3], offset = r[4];
+        const char *msg = NULL;
+
+        if (x < 0 || y < 0)
+            msg = "coordinates smaller than 0";
+        else if (w < 0 || h < 0)
+            msg = "dimensions smaller than 0";
+        else if (x >= width || y >= height)
+            msg = "coordinates exceed video's dimensions";
+        else if (w > width - x || h > height - y)
+            msg = "rectangle exceeds video's dimensions";
+        else if (offset < 0 || (size_t)offset > buf_len ||
+                 (size_t)w*h*3 > buf_len - offset)
+            msg = "rectangle data exceeds buffer's length";
+
+        if (msg) {
+            snprintf(error, error_len, "Rectangle %d (%d, %d, %d, %d at %d): %s.",
+                i, x, y, w, h, offset, msg);
+            return false;
+        }
+    }
+    return true;
+}
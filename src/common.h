@@ -2,14 +2,44 @@
 #define COMMON_H
 
 #include <node.h>
+#include <node_version.h>
+#include <uv.h>
 #include <cstring>
+#include <vector>
+#include <stdint.h>
 
 v8::Handle<v8::Value> ErrorException(const char *msg);
 v8::Handle<v8::Value> VException(const char *msg);
 
 bool str_eq(const char *s1, const char *s2);
 
+// libuv passes a status to after work callbacks since node 0.9.4
+#if NODE_VERSION_AT_LEAST(0,9,4)
+#define AFTER_WORK_ARGS uv_work_t *req, int status
+#else
+#define AFTER_WORK_ARGS uv_work_t *req
+#endif
+
+// and async callbacks lost theirs in the libuv of node 0.11.13
+#if NODE_VERSION_AT_LEAST(0,11,13)
+#define ASYNC_CB_ARGS uv_async_t *handle
+#else
+#define ASYNC_CB_ARGS uv_async_t *handle, int status
+#endif
+
 typedef enum { BUF_RGB, BUF_BGR, BUF_RGBA, BUF_BGRA } buffer_type;
 
+// (x, y, w, h, offset) tuples describing rectangles in a single rgb buffer,
+// as taken by pushMany.
+struct RectList {
+    const int32_t *rects;
+    int count;
+    std::vector<int32_t> storage;
+};
+
+bool rect_list_from_value(v8::Handle<v8::Value> value, RectList &list);
+bool check_rect_list(const RectList &list, size_t buf_len, int width, int height,
+    char *error, size_t error_len);
+
 #endif
 
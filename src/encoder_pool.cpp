@@ -0,0 +1,97 @@
+#include "encoder_pool.h"
+
+EncoderPool encoder_pool;
+
+EncoderPool::EncoderPool()
+{
+    pthread_mutex_init(&lock, NULL);
+}
+
+EncoderPool::~EncoderPool()
+{
+    clear();
+    pthread_mutex_destroy(&lock);
+}
+
+EncoderPool::Key
+EncoderPool::key(const th_info &info)
+{
+    return Key(std::make_pair((int)info.frame_width, (int)info.frame_height),
+        (int)info.pixel_fmt);
+}
+
+bool
+EncoderPool::same_layout(const th_info &a, const th_info &b)
+{
+    return a.frame_width == b.frame_width && a.frame_height == b.frame_height &&
+        a.pic_width == b.pic_width && a.pic_height == b.pic_height &&
+        a.pic_x == b.pic_x && a.pic_y == b.pic_y &&
+        a.fps_numerator == b.fps_numerator &&
+        a.fps_denominator == b.fps_denominator &&
+        a.aspect_numerator == b.aspect_numerator &&
+        a.aspect_denominator == b.aspect_denominator &&
+        a.colorspace == b.colorspace && a.pixel_fmt == b.pixel_fmt &&
+        a.keyframe_granule_shift == b.keyframe_granule_shift;
+}
+
+// Allocates count contexts for info, in quality mode. Returns how many were
+// allocated.
+int
+EncoderPool::fill(const th_info &info, int count)
+{
+    Entry entry;
+    entry.info = info;
+    entry.info.target_bitrate = 0;
+
+    std::vector<Entry> allocated;
+    for (int i = 0; i < count; i++) {
+        entry.td = th_encode_alloc(&entry.info);
+        if (!entry.td)
+            break;
+        allocated.push_back(entry);
+    }
+
+    pthread_mutex_lock(&lock);
+    std::vector<Entry> &bucket = entries[key(info)];
+    bucket.insert(bucket.end(), allocated.begin(), allocated.end());
+    pthread_mutex_unlock(&lock);
+
+    return allocated.size();
+}
+
+// Returns a context allocated for info or NULL if there's none.
+th_enc_ctx *
+EncoderPool::take(const th_info &info)
+{
+    th_enc_ctx *td = NULL;
+
+    pthread_mutex_lock(&lock);
+    std::map<Key, std::vector<Entry> >::iterator it = entries.find(key(info));
+    if (it != entries.end()) {
+        std::vector<Entry> &bucket = it->second;
+        for (size_t i = 0; i < bucket.size(); i++) {
+            if (same_layout(bucket[i].info, info)) {
+                td = bucket[i].td;
+                bucket.erase(bucket.begin() + i);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return td;
+}
+
+void
+EncoderPool::clear()
+{
+    pthread_mutex_lock(&lock);
+    std::map<Key, std::vector<Entry> >::iterator it;
+    for (it = entries.begin(); it != entries.end(); ++it) {
+        for (size_t i = 0; i < it->second.size(); i++)
+            th_encode_free(it->second[i].td);
+    }
+    entries.clear();
+    pthread_mutex_unlock(&lock);
+}
+
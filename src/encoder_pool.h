@@ -0,0 +1,43 @@
+#ifndef ENCODER_POOL_H
+#define ENCODER_POOL_H
+
+#include <map>
+#include <vector>
+#include <utility>
+#include <pthread.h>
+#include <theora/theoraenc.h>
+
+// Theora encoder contexts allocated ahead of time, so starting a video
+// doesn't have to wait for th_encode_alloc. Contexts are kept by frame size
+// and pixel format, and one is only handed out for a th_info that the
+// encoder can't change after allocation (picture, frame rate, granule
+// shift) the same as the one it was allocated with. Quality and bitrate can
+// be set with th_encode_ctl, so they don't have to match.
+//
+// take is called from work threads too.
+class EncoderPool {
+    struct Entry {
+        th_info info;
+        th_enc_ctx *td;
+    };
+
+    typedef std::pair<std::pair<int, int>, int> Key; // width, height, pixel_fmt
+    std::map<Key, std::vector<Entry> > entries;
+    pthread_mutex_t lock;
+
+    static Key key(const th_info &info);
+    static bool same_layout(const th_info &a, const th_info &b);
+
+public:
+    EncoderPool();
+    ~EncoderPool();
+
+    int fill(const th_info &info, int count);
+    th_enc_ctx *take(const th_info &info);
+    void clear();
+};
+
+extern EncoderPool encoder_pool;
+
+#endif
+
@@ -9,6 +9,11 @@ using namespace node;
 FixedVideo::FixedVideo(int width, int height) :
     videoEncoder(width, height) {}
 
+FixedVideo::~FixedVideo()
+{
+    segmentCallback.Dispose();
+}
+
 void
 FixedVideo::Initialize(Handle<Object> target)
 {
@@ -19,8 +24,20 @@ FixedVideo::Initialize(Handle<Object> target)
     NODE_SET_PROTOTYPE_METHOD(t, "newFrame", NewFrame);
     NODE_SET_PROTOTYPE_METHOD(t, "setOutputFile", SetOutputFile);
     NODE_SET_PROTOTYPE_METHOD(t, "setQuality", SetQuality);
+    NODE_SET_PROTOTYPE_METHOD(t, "setBitrate", SetBitrate);
+    NODE_SET_PROTOTYPE_METHOD(t, "setSpeed", SetSpeed);
+    NODE_SET_PROTOTYPE_METHOD(t, "setAutoSpeed", SetAutoSpeed);
+    NODE_SET_PROTOTYPE_METHOD(t, "setGovernor", SetGovernor);
+    NODE_SET_PROTOTYPE_METHOD(t, "stats", Stats);
     NODE_SET_PROTOTYPE_METHOD(t, "setFrameRate", SetFrameRate);
     NODE_SET_PROTOTYPE_METHOD(t, "setKeyFrameInterval", SetKeyFrameInterval);
+    NODE_SET_PROTOTYPE_METHOD(t, "forceKeyframe", ForceKeyframe);
+    NODE_SET_PROTOTYPE_METHOD(t, "setCrop", SetCrop);
+    NODE_SET_PROTOTYPE_METHOD(t, "setSegments", SetSegments);
+    NODE_SET_PROTOTYPE_METHOD(t, "setRingBuffer", SetRingBuffer);
+    NODE_SET_PROTOTYPE_METHOD(t, "dumpRing", DumpRing);
+    NODE_SET_PROTOTYPE_METHOD(t, "setStride", SetStride);
+    NODE_SET_PROTOTYPE_METHOD(t, "prepare", Prepare);
     NODE_SET_PROTOTYPE_METHOD(t, "end", End);
     target->Set(String::NewSymbol("FixedVideo"), t->GetFunction());
 }
@@ -43,6 +60,30 @@ FixedVideo::SetQuality(int quality)
     videoEncoder.setQuality(quality);
 }
 
+void
+FixedVideo::SetBitrate(int bitrate, int bufferDelay, int flags)
+{
+    videoEncoder.setBitrate(bitrate, bufferDelay, flags);
+}
+
+void
+FixedVideo::SetSpeed(int speed)
+{
+    videoEncoder.setSpeed(speed);
+}
+
+void
+FixedVideo::SetAutoSpeed(bool enabled)
+{
+    videoEncoder.setAutoSpeed(enabled);
+}
+
+void
+FixedVideo::SetGovernor(bool enabled)
+{
+    videoEncoder.setGovernor(enabled);
+}
+
 void
 FixedVideo::SetFrameRate(int frameRate)
 {
@@ -55,12 +96,66 @@ FixedVideo::SetKeyFrameInterval(int keyFrameInterval)
     videoEncoder.setKeyFrameInterval(keyFrameInterval);
 }
 
+void
+FixedVideo::ForceKeyframe()
+{
+    videoEncoder.forceKeyframe();
+}
+
+void
+FixedVideo::SetSegments(double seconds, unsigned long long bytes)
+{
+    videoEncoder.setSegments(seconds, bytes);
+}
+
+void
+FixedVideo::SetRingBuffer(double seconds, unsigned long long bytes)
+{
+    videoEncoder.setRingBuffer(seconds, bytes);
+}
+
+void
+FixedVideo::DumpRing(const char *fileName, double &duration, unsigned long long &bytes)
+{
+    videoEncoder.dumpRing(fileName, duration, bytes);
+}
+
+void
+FixedVideo::SetCrop(int x, int y, int w, int h)
+{
+    videoEncoder.setCrop(x, y, w, h);
+}
+
+void
+FixedVideo::SetStride(int stride)
+{
+    videoEncoder.setStride(stride);
+}
+
+void
+FixedVideo::Prepare()
+{
+    videoEncoder.prepare();
+}
+
 void
 FixedVideo::End()
 {
     videoEncoder.end();
 }
 
+// Tells the segment callback about segments finished since the last call.
+void
+FixedVideo::NotifySegments()
+{
+    std::vector<SegmentInfo> segments;
+    videoEncoder.takeClosedSegments(segments);
+    if (!segmentCallback.IsEmpty())
+        call_segment_callback(segmentCallback, segments);
+}
+
+
+
 Handle<Value>
 FixedVideo::New(const Arguments &args)
 {
@@ -104,10 +199,24 @@ FixedVideo::NewFrame(const Arguments &args)
 
     FixedVideo *fv = ObjectWrap::Unwrap<FixedVideo>(args.This());
 #if NODE_VERSION_AT_LEAST(0,3,0)
-    fv->NewFrame((unsigned char *) Buffer::Data(rgb));
+    size_t length = Buffer::Length(rgb);
 #else
-    fv->NewFrame((unsigned char *)rgb->data());
+    size_t length = rgb->length();
 #endif
+    if (length < fv->videoEncoder.getInputLength())
+        return VException("Buffer is too small for the frame size, stride and crop.");
+
+    try {
+#if NODE_VERSION_AT_LEAST(0,3,0)
+        fv->NewFrame((unsigned char *) Buffer::Data(rgb));
+#else
+        fv->NewFrame((unsigned char *)rgb->data());
+#endif
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+    fv->NotifySegments();
 
     return Undefined();
 }
@@ -153,6 +262,102 @@ FixedVideo::SetQuality(const Arguments &args)
     return Undefined();
 }
 
+Handle<Value>
+FixedVideo::SetBitrate(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1)
+        return VException("At least one argument required - bitrate in bits per second.");
+
+    if (!args[0]->IsInt32())
+        return VException("Bitrate must be integer.");
+
+    int bitrate = args[0]->Int32Value();
+
+    if (bitrate < 0) return VException("Bitrate smaller than 0.");
+
+    int bufferDelay, flags;
+    const char *error = rate_options_from_value(args[1], bufferDelay, flags);
+    if (error)
+        return VException(error);
+
+    FixedVideo *fv = ObjectWrap::Unwrap<FixedVideo>(args.This());
+    try {
+        fv->SetBitrate(bitrate, bufferDelay, flags);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+
+    return Undefined();
+}
+
+Handle<Value>
+FixedVideo::SetSpeed(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - encoder speed level.");
+
+    if (!args[0]->IsInt32())
+        return VException("Speed level must be integer.");
+
+    int speed = args[0]->Int32Value();
+
+    if (speed < 0) return VException("Speed level smaller than 0.");
+
+    FixedVideo *fv = ObjectWrap::Unwrap<FixedVideo>(args.This());
+    fv->SetSpeed(speed);
+
+    return Undefined();
+}
+
+Handle<Value>
+FixedVideo::SetAutoSpeed(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - true or false.");
+
+    if (!args[0]->IsBoolean())
+        return VException("First argument must be boolean.");
+
+    FixedVideo *fv = ObjectWrap::Unwrap<FixedVideo>(args.This());
+    fv->SetAutoSpeed(args[0]->BooleanValue());
+
+    return Undefined();
+}
+
+Handle<Value>
+FixedVideo::SetGovernor(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - true or false.");
+
+    if (!args[0]->IsBoolean())
+        return VException("First argument must be boolean.");
+
+    FixedVideo *fv = ObjectWrap::Unwrap<FixedVideo>(args.This());
+    fv->SetGovernor(args[0]->BooleanValue());
+
+    return Undefined();
+}
+
+Handle<Value>
+FixedVideo::Stats(const Arguments &args)
+{
+    HandleScope scope;
+
+    FixedVideo *fv = ObjectWrap::Unwrap<FixedVideo>(args.This());
+
+    return scope.Close(encoder_stats_object(fv->videoEncoder.getStats()));
+}
+
 Handle<Value>
 FixedVideo::SetFrameRate(const Arguments &args)
 {
@@ -166,7 +371,7 @@ FixedVideo::SetFrameRate(const Arguments &args)
 
     int rate = args[0]->Int32Value();
     
-    if (rate < 0)
+    if (rate < 1)
         return VException("Frame rate must be positive.");
 
     FixedVideo *fv = ObjectWrap::Unwrap<FixedVideo>(args.This());
@@ -188,18 +393,201 @@ FixedVideo::SetKeyFrameInterval(const Arguments &args)
 
     int interval = args[0]->Int32Value();
 
-    if (interval < 0)
+    if (interval < 1)
         return VException("Keyframe interval must be positive.");
 
-    if ((interval & (interval - 1)) != 0)
-        return VException("Keyframe interval must be a power of two.");
-
     FixedVideo *fv = ObjectWrap::Unwrap<FixedVideo>(args.This());
     fv->SetKeyFrameInterval(interval);
 
     return Undefined();
 }
 
+Handle<Value>
+FixedVideo::ForceKeyframe(const Arguments &args)
+{
+    HandleScope scope;
+
+    FixedVideo *fv = ObjectWrap::Unwrap<FixedVideo>(args.This());
+    fv->ForceKeyframe();
+
+    return Undefined();
+}
+
+Handle<Value>
+FixedVideo::SetSegments(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1)
+        return VException("At least one argument required - segment options.");
+
+    if (args.Length() > 1 && !args[1]->IsFunction())
+        return VException("Second argument must be a function.");
+
+    double seconds;
+    unsigned long long bytes;
+    const char *error = limit_options_from_value(args[0], seconds, bytes);
+    if (error)
+        return VException(error);
+
+    FixedVideo *fv = ObjectWrap::Unwrap<FixedVideo>(args.This());
+    try {
+        fv->SetSegments(seconds, bytes);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+
+    if (!fv->segmentCallback.IsEmpty()) {
+        fv->segmentCallback.Dispose();
+        fv->segmentCallback.Clear();
+    }
+    if (args.Length() > 1)
+        fv->segmentCallback = Persistent<Function>::New(Local<Function>::Cast(args[1]));
+
+    return Undefined();
+}
+
+Handle<Value>
+FixedVideo::SetRingBuffer(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - ring buffer options.");
+
+    double seconds;
+    unsigned long long bytes;
+    const char *error = limit_options_from_value(args[0], seconds, bytes);
+    if (error)
+        return VException(error);
+
+    FixedVideo *fv = ObjectWrap::Unwrap<FixedVideo>(args.This());
+    try {
+        fv->SetRingBuffer(seconds, bytes);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+
+    return Undefined();
+}
+
+Handle<Value>
+FixedVideo::DumpRing(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - output file name.");
+
+    if (!args[0]->IsString())
+        return VException("First argument must be string.");
+
+    String::AsciiValue fileName(args[0]->ToString());
+
+    FixedVideo *fv = ObjectWrap::Unwrap<FixedVideo>(args.This());
+
+    double duration;
+    unsigned long long bytes;
+    try {
+        fv->DumpRing(*fileName, duration, bytes);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+
+    Local<Object> result = Object::New();
+    result->Set(String::New("duration"), Number::New(duration));
+    result->Set(String::New("bytes"), Number::New(bytes));
+    return scope.Close(result);
+}
+
+Handle<Value>
+FixedVideo::SetCrop(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 4)
+        return VException("Four arguments required - x, y, width, height.");
+
+    if (!args[0]->IsInt32())
+        return VException("First argument must be integer x.");
+    if (!args[1]->IsInt32())
+        return VException("Second argument must be integer y.");
+    if (!args[2]->IsInt32())
+        return VException("Third argument must be integer width.");
+    if (!args[3]->IsInt32())
+        return VException("Fourth argument must be integer height.");
+
+    FixedVideo *fv = ObjectWrap::Unwrap<FixedVideo>(args.This());
+    int x = args[0]->Int32Value();
+    int y = args[1]->Int32Value();
+    int w = args[2]->Int32Value();
+    int h = args[3]->Int32Value();
+
+    if (x < 0)
+        return VException("Coordinate x smaller than 0.");
+    if (y < 0)
+        return VException("Coordinate y smaller than 0.");
+    if (w <= 0)
+        return VException("Width must be positive.");
+    if (h <= 0)
+        return VException("Height must be positive.");
+    if (x+w > fv->videoEncoder.getWidth())
+        return VException("Crop rectangle exceeds FixedVideo's width.");
+    if (y+h > fv->videoEncoder.getHeight())
+        return VException("Crop rectangle exceeds FixedVideo's height.");
+
+    try {
+        fv->SetCrop(x, y, w, h);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+
+    return Undefined();
+}
+
+Handle<Value>
+FixedVideo::SetStride(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - stride in bytes.");
+
+    if (!args[0]->IsInt32())
+        return VException("Stride must be integer.");
+
+    FixedVideo *fv = ObjectWrap::Unwrap<FixedVideo>(args.This());
+    int stride = args[0]->Int32Value();
+
+    if (stride < fv->videoEncoder.getWidth()*3)
+        return VException("Stride smaller than width*3.");
+
+    fv->SetStride(stride);
+
+    return Undefined();
+}
+
+Handle<Value>
+FixedVideo::Prepare(const Arguments &args)
+{
+    HandleScope scope;
+
+    FixedVideo *fv = ObjectWrap::Unwrap<FixedVideo>(args.This());
+
+    try {
+        fv->Prepare();
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+
+    return Undefined();
+}
+
 Handle<Value>
 FixedVideo::End(const Arguments &args)
 {
@@ -207,6 +595,7 @@ FixedVideo::End(const Arguments &args)
 
     FixedVideo *fv = ObjectWrap::Unwrap<FixedVideo>(args.This());
     fv->End();
+    fv->NotifySegments();
 
     return Undefined();
 }
@@ -7,24 +7,50 @@
 
 class FixedVideo : public node::ObjectWrap {
     VideoEncoder videoEncoder;
+    v8::Persistent<v8::Function> segmentCallback;
 
 public:
     FixedVideo(int width, int height);
+    ~FixedVideo();
     static void Initialize(v8::Handle<v8::Object> target);
     void NewFrame(const unsigned char *data);
     void SetOutputFile(const char *fileName);
     void SetQuality(int quality);
+    void SetBitrate(int bitrate, int bufferDelay, int flags);
+    void SetSpeed(int speed);
+    void SetAutoSpeed(bool enabled);
+    void SetGovernor(bool enabled);
     void SetFrameRate(int frameRate);
     void SetKeyFrameInterval(int keyFrameInterval);
+    void ForceKeyframe();
+    void SetCrop(int x, int y, int w, int h);
+    void SetSegments(double seconds, unsigned long long bytes);
+    void SetRingBuffer(double seconds, unsigned long long bytes);
+    void DumpRing(const char *fileName, double &duration, unsigned long long &bytes);
+    void SetStride(int stride);
+    void Prepare();
     void End();
+    void NotifySegments();
 
 protected:
     static v8::Handle<v8::Value> New(const v8::Arguments &args);
     static v8::Handle<v8::Value> NewFrame(const v8::Arguments &args);
     static v8::Handle<v8::Value> SetOutputFile(const v8::Arguments &args);
     static v8::Handle<v8::Value> SetQuality(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetBitrate(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetSpeed(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetAutoSpeed(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetGovernor(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Stats(const v8::Arguments &args);
     static v8::Handle<v8::Value> SetFrameRate(const v8::Arguments &args);
     static v8::Handle<v8::Value> SetKeyFrameInterval(const v8::Arguments &args);
+    static v8::Handle<v8::Value> ForceKeyframe(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetCrop(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetSegments(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetRingBuffer(const v8::Arguments &args);
+    static v8::Handle<v8::Value> DumpRing(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetStride(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Prepare(const v8::Arguments &args);
     static v8::Handle<v8::Value> End(const v8::Arguments &args);
 };
 
@@ -0,0 +1,571 @@
+#include <cstdio>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+
+#include "utils.h"
+#include "rle.h"
+#include "fragment_store.h"
+
+unsigned char *
+Arena::alloc(size_t n)
+{
+    if (chunks.empty() || chunks.back().size - chunks.back().used < n) {
+        Chunk chunk;
+        size_t chunk_size = chunks.empty() ? MIN_CHUNK_SIZE : chunks.back().size*2;
+        if (chunk_size > CHUNK_SIZE)
+            chunk_size = CHUNK_SIZE;
+        chunk.size = n > chunk_size ? n : chunk_size;
+        chunk.used = 0;
+        chunk.base = (unsigned char *)malloc(chunk.size);
+        if (!chunk.base)
+            return NULL;
+        chunks.push_back(chunk);
+        total += chunk.size;
+    }
+
+    Chunk &chunk = chunks.back();
+    unsigned char *p = chunk.base + chunk.used;
+    chunk.used += n;
+    return p;
+}
+
+void
+Arena::release()
+{
+    for (size_t i = 0; i < chunks.size(); i++)
+        free(chunks[i].base);
+    chunks.clear();
+    total = 0;
+}
+
+FragmentStore::FragmentStore() :
+    fd(-1), index_fd(-1), size(0), index_size(0), memory_limit(0), memory_used(0), compress(false),
+    current(NULL)
+{
+    pthread_mutex_init(&lock, NULL);
+}
+
+FragmentStore::~FragmentStore()
+{
+    close();
+    delete current;
+    for (size_t i = 0; i < frames.size(); i++)
+        delete frames[i];
+    pthread_mutex_destroy(&lock);
+}
+
+// Writes all of iov at offset of fd.
+static bool
+write_all(int fd, off_t offset, struct iovec *iov, int iovcnt)
+{
+    if (lseek(fd, offset, SEEK_SET) == -1)
+        return false;
+
+    while (iovcnt > 0) {
+        int n = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+        ssize_t written = writev(fd, iov, n);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        while (n > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++; iovcnt--; n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+bool
+FragmentStore::open(const char *dir, const StoreHeader &header)
+{
+    if (!is_dir(dir)) {
+        if (mkdir(dir, 0775) == -1)
+            return false;
+    }
+
+    path = std::string(dir) + "/fragments.journal";
+    index_path = std::string(dir) + "/fragments.index";
+    fd = ::open(path.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0664);
+    if (fd == -1)
+        return false;
+
+    index_fd = ::open(index_path.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0664);
+    if (index_fd == -1) {
+        close();
+        return false;
+    }
+
+    size = 0;
+    index_size = 0;
+
+    struct iovec iov;
+    iov.iov_base = (void *)&header;
+    iov.iov_len = sizeof(header);
+    if (!write_all(index_fd, 0, &iov, 1)) {
+        close();
+        return false;
+    }
+    index_size = sizeof(header);
+
+    return true;
+}
+
+void
+FragmentStore::close()
+{
+    if (fd != -1) ::close(fd);
+    if (index_fd != -1) ::close(index_fd);
+    fd = -1;
+    index_fd = -1;
+}
+
+size_t
+FragmentStore::memoryUsed()
+{
+    pthread_mutex_lock(&lock);
+    size_t used = memory_used;
+    pthread_mutex_unlock(&lock);
+    return used;
+}
+
+void
+FragmentStore::keep(unsigned int frame_id, unsigned int fragment_id,
+    int x, int y, int w, int h, const unsigned char *data, unsigned int length)
+{
+    if (!current)
+        current = new FrameBatch(frame_id);
+
+    size_t held = current->arena.size();
+    unsigned char *copy = current->arena.alloc(length);
+    if (!copy)
+        throw "malloc failed in FragmentStore::keep.";
+    memcpy(copy, data, length);
+
+    FragmentEntry entry;
+    entry.fragment_id = fragment_id;
+    entry.x = x;
+    entry.y = y;
+    entry.w = w;
+    entry.h = h;
+    entry.length = length;
+    entry.offset = 0;
+    entry.codec = FragmentRecord::CODEC_RAW;
+    entry.stored_length = length;
+    entry.data = copy;
+    current->fragments.push_back(entry);
+
+    pthread_mutex_lock(&lock);
+    memory_used += current->arena.size() - held;
+    pthread_mutex_unlock(&lock);
+}
+
+void
+FragmentStore::endFrame(unsigned int frame_id, unsigned long timestamp)
+{
+    if (!current)
+        current = new FrameBatch(frame_id);
+    current->timestamp = timestamp;
+
+    pthread_mutex_lock(&lock);
+    frames.push_back(current);
+    pthread_mutex_unlock(&lock);
+
+    current = NULL;
+}
+
+// Queues all frames that are only in memory for writing. They are marked as
+// being written right away so encoding doesn't overtake them.
+void
+FragmentStore::queueWrite()
+{
+    pthread_mutex_lock(&lock);
+    for (size_t i = 0; i < frames.size(); i++) {
+        if (frames[i]->state == FrameBatch::MEMORY) {
+            frames[i]->state = FrameBatch::WRITING;
+            write_queue.push_back(frames[i]);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// Takes everything queued so far for the next write.
+WriteBatch *
+FragmentStore::takeBatch()
+{
+    WriteBatch *batch = new WriteBatch;
+    batch->store = this;
+    batch->frames.swap(write_queue);
+    return batch;
+}
+
+static void
+fill_record(FragmentRecord &rec, unsigned int frame_id, const FragmentEntry &entry)
+{
+    rec.magic = FragmentRecord::MAGIC;
+    rec.frame_id = frame_id;
+    rec.fragment_id = entry.fragment_id;
+    rec.x = entry.x;
+    rec.y = entry.y;
+    rec.w = entry.w;
+    rec.h = entry.h;
+    rec.length = entry.length;
+    rec.codec = FragmentRecord::CODEC_RAW;
+}
+
+
+// Appends index records of the frames of batch, which were just written to
+// the journal at size with recs.
+bool
+FragmentStore::write_index(WriteBatch *batch, const std::vector<FragmentRecord> &recs)
+{
+    std::vector<unsigned char> index;
+    off_t offset = size;
+    size_t k = 0;
+
+    for (size_t i = 0; i < batch->frames.size(); i++) {
+        FrameBatch *frame = batch->frames[i];
+
+        FrameIndexRecord rec;
+        rec.magic = FrameIndexRecord::MAGIC;
+        rec.frame_id = frame->frame_id;
+        rec.fragment_count = frame->fragments.size();
+        rec.flags = 0;
+        rec.timestamp = frame->timestamp;
+        rec.journal_start = offset;
+
+        size_t rec_pos = index.size();
+        frame->index_offset = index_size + rec_pos;
+        index.resize(rec_pos + sizeof(rec) + rec.fragment_count*sizeof(FragmentIndexEntry));
+
+        FragmentIndexEntry *entries = (FragmentIndexEntry *)&index[rec_pos + sizeof(rec)];
+        for (size_t j = 0; j < frame->fragments.size(); j++, k++) {
+            FragmentIndexEntry &entry = entries[j];
+            entry.offset = offset + sizeof(FragmentRecord);
+            entry.x = recs[k].x;
+            entry.y = recs[k].y;
+            entry.w = recs[k].w;
+            entry.h = recs[k].h;
+            entry.length = frame->fragments[j].length;
+            entry.stored_length = recs[k].length;
+            entry.codec = recs[k].codec;
+            entry.reserved = 0;
+            offset += sizeof(FragmentRecord) + recs[k].length;
+        }
+
+        rec.journal_end = offset;
+        memcpy(&index[rec_pos], &rec, sizeof(rec));
+    }
+
+    if (index.empty())
+        return true;
+
+    struct iovec iov;
+    iov.iov_base = &index[0];
+    iov.iov_len = index.size();
+    if (!write_all(index_fd, index_size, &iov, 1))
+        return false;
+
+    index_size += index.size();
+    return true;
+}
+
+// Only the writer touches the journal's end and frames in WRITING state, so
+// lock is only needed to publish the result.
+bool
+FragmentStore::write(WriteBatch *batch)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < batch->frames.size(); i++)
+        n += batch->frames[i]->fragments.size();
+
+    std::vector<FragmentRecord> recs(n);
+    std::vector<struct iovec> iov(2*n);
+
+    // compressed copies of the fragments, they're only needed for the write
+    Arena packed;
+    std::vector<unsigned char> scratch;
+
+    size_t k = 0;
+    for (size_t i = 0; i < batch->frames.size(); i++) {
+        FrameBatch *frame = batch->frames[i];
+        for (size_t j = 0; j < frame->fragments.size(); j++, k++) {
+            const FragmentEntry &entry = frame->fragments[j];
+            fill_record(recs[k], frame->frame_id, entry);
+            const unsigned char *data = entry.data;
+
+            if (compress && entry.length > 0) {
+                scratch.resize(rle_bound(entry.length));
+                size_t packed_len = rle_encode(entry.data, entry.w, entry.h, &scratch[0]);
+                unsigned char *p;
+                if (packed_len < entry.length && (p = packed.alloc(packed_len))) {
+                    memcpy(p, &scratch[0], packed_len);
+                    data = p;
+                    recs[k].length = packed_len;
+                    recs[k].codec = FragmentRecord::CODEC_RLE;
+                }
+            }
+
+            iov[2*k].iov_base = &recs[k];
+            iov[2*k].iov_len = sizeof(recs[k]);
+            iov[2*k + 1].iov_base = (void *)data;
+            iov[2*k + 1].iov_len = recs[k].length;
+        }
+    }
+
+    // on failure size is left as is, the next write overwrites the partial records
+    bool ok = n == 0 || write_all(fd, size, &iov[0], iov.size());
+    if (ok)
+        ok = write_index(batch, recs);
+
+    pthread_mutex_lock(&lock);
+
+    off_t offset = size;
+    k = 0;
+    for (size_t i = 0; i < batch->frames.size(); i++) {
+        FrameBatch *frame = batch->frames[i];
+        if (!ok) {
+            frame->state = FrameBatch::MEMORY;
+            continue;
+        }
+        frame->journal_start = offset;
+        for (size_t j = 0; j < frame->fragments.size(); j++, k++) {
+            FragmentEntry &entry = frame->fragments[j];
+            entry.offset = offset + sizeof(FragmentRecord);
+            entry.codec = recs[k].codec;
+            entry.stored_length = recs[k].length;
+            entry.data = NULL;
+            offset += sizeof(FragmentRecord) + entry.stored_length;
+        }
+        frame->journal_end = offset;
+        memory_used -= frame->arena.size();
+        frame->arena.release();
+        frame->state = FrameBatch::JOURNAL;
+    }
+    size = offset;
+
+    pthread_mutex_unlock(&lock);
+    return ok;
+}
+
+bool
+FragmentStore::hasReadyFrames()
+{
+    pthread_mutex_lock(&lock);
+    bool ready = !frames.empty() && frames.front()->state != FrameBatch::WRITING;
+    pthread_mutex_unlock(&lock);
+    return ready;
+}
+
+// Takes completed frames out of the store, in order, stopping at the first one
+// that is being written. Returns the size of the journal the taken frames
+// are in.
+off_t
+FragmentStore::takeFrames(std::vector<FrameBatch *> &taken)
+{
+    pthread_mutex_lock(&lock);
+    while (!frames.empty() && frames.front()->state != FrameBatch::WRITING) {
+        taken.push_back(frames.front());
+        frames.pop_front();
+    }
+    off_t journal_size = size;
+    pthread_mutex_unlock(&lock);
+
+    return journal_size;
+}
+
+// Frees everything a taken frame uses. If free_journal is set, its space in
+// the journal is given back to the filesystem too, after marking it
+// discarded in the index.
+void
+FragmentStore::discard(FrameBatch *frame, bool free_journal)
+{
+    if (free_journal && frame->state == FrameBatch::JOURNAL &&
+        frame->journal_end > frame->journal_start)
+    {
+        // the index has to say the frame is gone before it's punched, or a
+        // recovery would replay the hole
+        uint32_t flags = FrameIndexRecord::DISCARDED;
+        off_t flags_offset = frame->index_offset + offsetof(FrameIndexRecord, flags);
+        if (pwrite(index_fd, &flags, sizeof(flags), flags_offset) == sizeof(flags)) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+            fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                frame->journal_start, frame->journal_end - frame->journal_start);
+#endif
+        }
+    }
+
+    pthread_mutex_lock(&lock);
+    memory_used -= frame->arena.size();
+    pthread_mutex_unlock(&lock);
+
+    delete frame;
+}
+
+// Loads the frames of a store left behind in dir, for encoding them. Frames
+// are loaded up to the first one that didn't make it to disk completely.
+// Frames discarded by incremental encoding are skipped. Returns false if dir
+// doesn't have a store in it.
+bool
+FragmentStore::load(const char *dir, StoreHeader &header,
+    std::vector<FrameBatch *> &frames, off_t &journal_size)
+{
+    std::string journal_path = std::string(dir) + "/fragments.journal";
+    std::string index_path = std::string(dir) + "/fragments.index";
+
+    struct stat st;
+    if (stat(journal_path.c_str(), &st) == -1)
+        return false;
+    journal_size = st.st_size;
+
+    FILE *fp = fopen(index_path.c_str(), "rb");
+    if (!fp)
+        return false;
+
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        header.magic != StoreHeader::MAGIC || header.version != StoreHeader::VERSION ||
+        header.width <= 0 || header.width > StoreHeader::MAX_DIMENSION ||
+        header.height <= 0 || header.height > StoreHeader::MAX_DIMENSION ||
+        header.frame_rate <= 0 || header.keyframe_interval <= 0 ||
+        header.quality < 0 || header.quality > 63 ||
+        (header.rate_flags & ~StoreHeader::RATE_FLAGS) != 0 ||
+        header.crop_x < 0 || header.crop_w <= 0 || header.crop_x + header.crop_w > header.width ||
+        header.crop_y < 0 || header.crop_h <= 0 || header.crop_y + header.crop_h > header.height ||
+        header.bitrate < 0 || header.rate_buffer < 0)
+    {
+        fclose(fp);
+        return false;
+    }
+
+    off_t end = 0;
+    FrameIndexRecord rec;
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+        if (rec.magic != FrameIndexRecord::MAGIC ||
+            rec.journal_start != (uint64_t)end || rec.journal_end > (uint64_t)journal_size)
+        {
+            break;
+        }
+
+        FrameBatch *frame = new FrameBatch(rec.frame_id);
+        frame->timestamp = rec.timestamp;
+        frame->state = FrameBatch::JOURNAL;
+        frame->journal_start = rec.journal_start;
+        frame->journal_end = rec.journal_end;
+
+        bool complete = true;
+        for (uint32_t i = 0; i < rec.fragment_count && complete; i++) {
+            FragmentIndexEntry e;
+            if (fread(&e, sizeof(e), 1, fp) != 1 ||
+                e.x < 0 || e.y < 0 || e.w <= 0 || e.h <= 0 ||
+                e.x + e.w > header.width || e.y + e.h > header.height ||
+                e.length != (uint32_t)e.w*e.h*3 ||
+                (e.codec != FragmentRecord::CODEC_RAW && e.codec != FragmentRecord::CODEC_RLE) ||
+                (e.codec == FragmentRecord::CODEC_RAW && e.stored_length != e.length) ||
+                e.offset < rec.journal_start || e.offset + e.stored_length > rec.journal_end ||
+                e.offset + e.stored_length > (uint64_t)journal_size)
+            {
+                complete = false;
+                break;
+            }
+
+            FragmentEntry entry;
+            entry.fragment_id = i;
+            entry.x = e.x;
+            entry.y = e.y;
+            entry.w = e.w;
+            entry.h = e.h;
+            entry.length = e.length;
+            entry.offset = e.offset;
+            entry.codec = e.codec;
+            entry.stored_length = e.stored_length;
+            entry.data = NULL;
+            frame->fragments.push_back(entry);
+        }
+
+        if (!complete) {
+            delete frame;
+            break;
+        }
+        if (rec.flags & FrameIndexRecord::DISCARDED)
+            delete frame;
+        else
+            frames.push_back(frame);
+        end = rec.journal_end;
+    }
+
+    fclose(fp);
+    return true;
+}
+
+JournalMapping::JournalMapping() :
+    map(NULL), length(0), dropped(0), fd(-1) {}
+
+JournalMapping::~JournalMapping()
+{
+    close();
+}
+
+bool
+JournalMapping::open(const char *path, off_t size)
+{
+    close();
+
+    if (size == 0)
+        return true;
+
+    fd = ::open(path, O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    void *m = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+        close();
+        return false;
+    }
+
+    map = (const unsigned char *)m;
+    length = size;
+    dropped = 0;
+    madvise(m, length, MADV_SEQUENTIAL);
+    return true;
+}
+
+void
+JournalMapping::close()
+{
+    if (map) munmap((void *)map, length);
+    if (fd != -1) ::close(fd);
+    map = NULL;
+    length = 0;
+    dropped = 0;
+    fd = -1;
+}
+
+void
+JournalMapping::consumed(off_t offset)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t upto = ((size_t)offset/page_size)*page_size;
+
+    if (upto < dropped + DROP_BEHIND_CHUNK)
+        return;
+
+    madvise((void *)(map + dropped), upto - dropped, MADV_DONTNEED);
+    posix_fadvise(fd, dropped, upto - dropped, POSIX_FADV_DONTNEED);
+    dropped = upto;
+}
+
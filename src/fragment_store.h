@@ -0,0 +1,211 @@
+#ifndef FRAGMENT_STORE_H
+#define FRAGMENT_STORE_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Every fragment is appended to the journal as a FragmentRecord followed by
+// its data, length bytes of rgb coded with codec.
+struct FragmentRecord {
+    uint32_t magic;
+    uint32_t frame_id;
+    uint32_t fragment_id;
+    int32_t x, y, w, h;
+    uint32_t length;
+    uint32_t codec;
+
+    static const uint32_t MAGIC = 0x47415246; // "FRAG"
+    enum { CODEC_RAW = 0, CODEC_RLE = 1 };
+};
+
+// The index starts with a StoreHeader describing the video the fragments are
+// for, so that a store can be encoded without the process that pushed them.
+struct StoreHeader {
+    uint32_t magic;
+    uint32_t version;
+    int32_t width, height;
+    int32_t frame_rate, quality, keyframe_interval;
+    int32_t crop_x, crop_y, crop_w, crop_h;
+    int32_t bitrate, rate_buffer, rate_flags;
+    uint32_t reserved;
+
+    static const uint32_t MAGIC = 0x4f545346; // "FSTO"
+    static const uint32_t VERSION = 1;
+    // largest width or height load accepts, Theora's limit is in the same
+    // ballpark and frames this size still fit in an int
+    static const int32_t MAX_DIMENSION = 16384;
+    // TH_RATECTL_DROP_FRAMES|TH_RATECTL_CAP_OVERFLOW|TH_RATECTL_CAP_UNDERFLOW
+    static const int32_t RATE_FLAGS = 0x7;
+};
+
+// For every frame written to the journal, the index gets a FrameIndexRecord
+// followed by fragment_count FragmentIndexEntries, in push order. It's the
+// journal's table of contents: where each frame's fragments are and how
+// they're coded, without scanning the journal.
+//
+// When incremental encoding discards a frame from the journal, DISCARDED is
+// set in its record's flags before its space is given back, so a recovery
+// doesn't replay the hole.
+struct FrameIndexRecord {
+    uint32_t magic;
+    uint32_t frame_id;
+    uint32_t fragment_count;
+    uint32_t flags;
+    uint64_t timestamp;
+    uint64_t journal_start, journal_end;
+
+    static const uint32_t MAGIC = 0x58444946; // "FIDX"
+    enum { DISCARDED = 1 };
+};
+
+struct FragmentIndexEntry {
+    uint64_t offset; // of fragment's data in the journal
+    int32_t x, y, w, h;
+    uint32_t length, stored_length, codec;
+    uint32_t reserved;
+};
+
+struct FragmentEntry {
+    unsigned int fragment_id;
+    int x, y, w, h;
+    unsigned int length; // of rgb data
+    off_t offset; // of fragment's data in the journal
+    unsigned int codec, stored_length; // of fragment's data in the journal
+    const unsigned char *data; // fragment's rgb data while it's in memory
+};
+
+// Bump allocator for fragments kept in memory. Memory is handed out from
+// chunks and released all at once. Chunks start small and double up to
+// CHUNK_SIZE, so a frame with a few small fragments doesn't hold megabytes.
+// size() is the memory held by the chunks, not just the part handed out.
+class Arena {
+    struct Chunk {
+        unsigned char *base;
+        size_t used, size;
+    };
+    std::vector<Chunk> chunks;
+    size_t total;
+
+public:
+    static const size_t MIN_CHUNK_SIZE = 64*1024;
+    static const size_t CHUNK_SIZE = 4*1024*1024;
+
+    Arena() : total(0) {}
+    ~Arena() { release(); }
+
+    unsigned char *alloc(size_t n);
+    void release();
+    size_t size() const { return total; }
+};
+
+// All fragments of one frame, in the order they were pushed.
+struct FrameBatch {
+    enum State { MEMORY, WRITING, JOURNAL };
+
+    unsigned int frame_id;
+    unsigned long timestamp;
+    State state;
+    std::vector<FragmentEntry> fragments;
+    Arena arena; // data of the fragments while the frame is in memory
+    off_t journal_start, journal_end;
+    off_t index_offset; // of the frame's FrameIndexRecord, -1 if it has none
+
+    FrameBatch(unsigned int fframe_id) :
+        frame_id(fframe_id), timestamp(0), state(MEMORY),
+        journal_start(0), journal_end(0), index_offset(-1) {}
+};
+
+class FragmentStore;
+
+// Frames that are written to the journal together.
+struct WriteBatch {
+    FragmentStore *store;
+    std::vector<FrameBatch *> frames;
+};
+
+// Fragments of completed frames, kept in memory until memoryLimit is exceeded
+// and then written to an append-only journal in large batches. Frames are
+// taken out of the store in order for encoding, either all at the end or one
+// batch at a time while pushes are still coming in.
+//
+// Frames to be written are queued with queueWrite and written by a single
+// writer at a time (the owner makes sure of that), so the journal is always
+// in push order. Everything queued while a write is in flight goes into the
+// next write together.
+//
+// keep, endFrame, queueWrite and takeBatch are called from the main thread,
+// write and takeFrames from work threads.
+class FragmentStore {
+    std::string path, index_path;
+    int fd, index_fd;
+    off_t size, index_size;
+    pthread_mutex_t lock;
+
+    size_t memory_limit, memory_used;
+    bool compress;
+    FrameBatch *current;
+    std::deque<FrameBatch *> frames;
+    std::vector<FrameBatch *> write_queue;
+
+    bool write_index(WriteBatch *batch, const std::vector<FragmentRecord> &recs);
+
+public:
+    FragmentStore();
+    ~FragmentStore();
+
+    bool open(const char *dir, const StoreHeader &header);
+    bool isOpen() const { return fd != -1; }
+    const char *journalPath() const { return path.c_str(); }
+    const char *indexPath() const { return index_path.c_str(); }
+    void close();
+
+    void setMemoryLimit(size_t limit) { memory_limit = limit; }
+    size_t memoryLimit() const { return memory_limit; }
+    size_t memoryUsed();
+
+    void setCompression(bool enabled) { compress = enabled; }
+
+    void keep(unsigned int frame_id, unsigned int fragment_id,
+        int x, int y, int w, int h, const unsigned char *data, unsigned int length);
+    void endFrame(unsigned int frame_id, unsigned long timestamp);
+
+    void queueWrite();
+    bool hasQueuedWrites() const { return !write_queue.empty(); }
+    WriteBatch *takeBatch();
+    bool write(WriteBatch *batch);
+
+    bool hasReadyFrames();
+    off_t takeFrames(std::vector<FrameBatch *> &taken);
+    void discard(FrameBatch *frame, bool free_journal);
+
+    static bool load(const char *dir, StoreHeader &header,
+        std::vector<FrameBatch *> &frames, off_t &journal_size);
+};
+
+// Read-only mapping of a journal for replaying it front to back. Pages that
+// were replayed are dropped from memory and page cache as we go, so RSS stays
+// bounded no matter how large the journal is.
+class JournalMapping {
+    const unsigned char *map;
+    size_t length;
+    size_t dropped;
+    int fd;
+
+public:
+    static const size_t DROP_BEHIND_CHUNK = 16*1024*1024;
+
+    JournalMapping();
+    ~JournalMapping();
+
+    bool open(const char *path, off_t size);
+    void close();
+    const unsigned char *data(off_t offset) const { return map + offset; }
+    void consumed(off_t offset);
+};
+
+#endif
+
@@ -1,9 +1,76 @@
 #include <node.h>
 
+#include "common.h"
+#include "video_encoder.h"
+#include "encoder_pool.h"
 #include "fixed_video.h"
 #include "stacked_video.h"
 #include "async_stacked_video.h"
 
+using namespace v8;
+
+static Handle<Value>
+PreallocateEncoders(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 3)
+        return VException("At least three arguments required - width, height, count.");
+
+    if (!args[0]->IsInt32())
+        return VException("First argument must be integer width.");
+    if (!args[1]->IsInt32())
+        return VException("Second argument must be integer height.");
+    if (!args[2]->IsInt32())
+        return VException("Third argument must be integer count.");
+
+    int w = args[0]->Int32Value();
+    int h = args[1]->Int32Value();
+    int count = args[2]->Int32Value();
+
+    if (w <= 0)
+        return VException("Width must be positive.");
+    if (h <= 0)
+        return VException("Height must be positive.");
+    if (count < 0)
+        return VException("Count can't be negative.");
+
+    VideoEncoder encoder(w, h);
+
+    if (args.Length() > 3 && !args[3]->IsUndefined()) {
+        if (!args[3]->IsObject())
+            return VException("Options must be an object.");
+
+        Local<Object> options = args[3]->ToObject();
+        static const char *names[] = {
+            "frameRate", "keyFrameInterval", "maxKeyFrameInterval"
+        };
+        for (int i = 0; i < 3; i++) {
+            Local<Value> value = options->Get(String::New(names[i]));
+            if (value->IsUndefined())
+                continue;
+            if (!value->IsInt32() || value->Int32Value() < (i == 2 ? 0 : 1))
+                return VException("frameRate, keyFrameInterval and maxKeyFrameInterval must be positive integers.");
+            int n = value->Int32Value();
+            if (i == 0) encoder.setFrameRate(n);
+            else if (i == 1) encoder.setKeyFrameInterval(n);
+            else encoder.setMaxKeyFrameInterval(n);
+        }
+    }
+
+    return scope.Close(Integer::New(encoder.preallocate(count)));
+}
+
+static Handle<Value>
+ReleaseEncoders(const Arguments &args)
+{
+    HandleScope scope;
+
+    encoder_pool.clear();
+
+    return Undefined();
+}
+
 extern "C" void
 init(v8::Handle<v8::Object> target)
 {
@@ -12,5 +79,7 @@ init(v8::Handle<v8::Object> target)
     FixedVideo::Initialize(target);
     StackedVideo::Initialize(target);
     AsyncStackedVideo::Initialize(target);
-}
 
+    NODE_SET_METHOD(target, "preallocateEncoders", PreallocateEncoders);
+    NODE_SET_METHOD(target, "releaseEncoders", ReleaseEncoders);
+}
@@ -0,0 +1,149 @@
+#include <cstring>
+#include "rle.h"
+
+// packet header: 2 bits of op, 6 bits of pixel count - 1
+enum { RLE_LITERAL = 0, RLE_RUN = 1, RLE_ABOVE = 2 };
+static const size_t MAX_COUNT = 64;
+
+static inline unsigned int
+pixel_at(const unsigned char *rgb, size_t i)
+{
+    const unsigned char *p = rgb + i*3;
+    return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+static size_t
+run_length(const unsigned char *rgb, size_t i, size_t pixels)
+{
+    unsigned int p = pixel_at(rgb, i);
+    size_t n = 1;
+    while (n < MAX_COUNT && i + n < pixels && pixel_at(rgb, i + n) == p)
+        n++;
+    return n;
+}
+
+static size_t
+above_length(const unsigned char *rgb, size_t i, size_t pixels, size_t width)
+{
+    size_t n = 0;
+    while (n < MAX_COUNT && i + n < pixels &&
+        pixel_at(rgb, i + n) == pixel_at(rgb, i + n - width))
+    {
+        n++;
+    }
+    return n;
+}
+
+static unsigned char *
+flush_literal(const unsigned char *rgb, size_t start, size_t end, unsigned char *out)
+{
+    while (start < end) {
+        size_t n = end - start < MAX_COUNT ? end - start : MAX_COUNT;
+        *out++ = (RLE_LITERAL << 6) | (n - 1);
+        memcpy(out, rgb + start*3, n*3);
+        out += n*3;
+        start += n;
+    }
+    return out;
+}
+
+// Largest possible size of encoded length bytes of rgb data.
+size_t
+rle_bound(size_t length)
+{
+    size_t pixels = length/3;
+    return length + (pixels + MAX_COUNT - 1)/MAX_COUNT;
+}
+
+// Encodes width x height rgb image to out, which must have room for
+// rle_bound(width*height*3) bytes. Returns the encoded size.
+size_t
+rle_encode(const unsigned char *rgb, int width, int height, unsigned char *out)
+{
+    size_t pixels = (size_t)width*height;
+    size_t i = 0, literal = 0;
+    unsigned char *o = out;
+
+    while (i < pixels) {
+        size_t run = run_length(rgb, i, pixels);
+        size_t above = i >= (size_t)width ? above_length(rgb, i, pixels, width) : 0;
+
+        // a pair is already cheaper as a run or copy than as literals
+        if (run < 2 && above < 2) {
+            i++;
+            continue;
+        }
+
+        o = flush_literal(rgb, literal, i, o);
+        if (above >= run) {
+            *o++ = (RLE_ABOVE << 6) | (above - 1);
+            i += above;
+        }
+        else {
+            *o++ = (RLE_RUN << 6) | (run - 1);
+            memcpy(o, rgb + i*3, 3);
+            o += 3;
+            i += run;
+        }
+        literal = i;
+    }
+    o = flush_literal(rgb, literal, i, o);
+
+    return o - out;
+}
+
+// Decodes length bytes of in to width x height rgb image. Returns false if
+// the data is corrupt.
+bool
+rle_decode(const unsigned char *in, size_t length, int width, int height,
+    unsigned char *rgb)
+{
+    size_t pixels = (size_t)width*height;
+    size_t stride = (size_t)width*3;
+    const unsigned char *end = in + length;
+    size_t i = 0;
+
+    while (i < pixels) {
+        if (in >= end)
+            return false;
+
+        int op = *in >> 6;
+        size_t n = (*in & 0x3f) + 1;
+        in++;
+        if (n > pixels - i)
+            return false;
+
+        unsigned char *o = rgb + i*3;
+        switch (op) {
+        case RLE_LITERAL:
+            if ((size_t)(end - in) < n*3)
+                return false;
+            memcpy(o, in, n*3);
+            in += n*3;
+            break;
+        case RLE_RUN:
+            if (end - in < 3)
+                return false;
+            for (size_t k = 0; k < n; k++, o += 3) {
+                o[0] = in[0];
+                o[1] = in[1];
+                o[2] = in[2];
+            }
+            in += 3;
+            break;
+        case RLE_ABOVE:
+            if (i < (size_t)width)
+                return false;
+            // rows narrower than the packet overlap it, so copy forward
+            for (size_t k = 0; k < n*3; k++)
+                o[k] = (o - stride)[k];
+            break;
+        default:
+            return false;
+        }
+        i += n;
+    }
+
+    return in == end;
+}
+
@@ -0,0 +1,17 @@
+#ifndef RLE_H
+#define RLE_H
+
+#include <cstddef>
+
+// Fast lossless codec for rgb fragments of screen content. The image is coded
+// as packets of up to 64 pixels: literal pixels, a run of one pixel, or a
+// copy of the pixels one row above. Flat areas and rows repeated vertically
+// (backgrounds, text lines) shrink to a fraction of a byte per pixel.
+
+size_t rle_bound(size_t length);
+size_t rle_encode(const unsigned char *rgb, int width, int height, unsigned char *out);
+bool rle_decode(const unsigned char *in, size_t length, int width, int height,
+    unsigned char *rgb);
+
+#endif
+
@@ -1,4 +1,6 @@
 #include <cstdlib>
+#include <cerrno>
+#include <stdint.h>
 #include <node_buffer.h>
 #include <node_version.h>
 #include "common.h"
@@ -7,13 +9,67 @@
 using namespace v8;
 using namespace node;
 
+// Moves a w x h rectangle inside of frame from (sx, sy) to (dx, dy).
+// Rows are walked bottom-up when moving down so overlapping areas (scrolls)
+// are copied correctly, memmove takes care of horizontal overlap.
+static void
+copy_rect(unsigned char *frame, int width, int sx, int sy, int dx, int dy,
+    int w, int h)
+{
+    int stride = width*3;
+    unsigned char *src = frame + sy*stride + sx*3;
+    unsigned char *dst = frame + dy*stride + dx*3;
+
+    if (dy > sy) {
+        for (int i = h-1; i >= 0; i--)
+            memmove(dst + i*stride, src + i*stride, w*3);
+    }
+    else {
+        for (int i = 0; i < h; i++)
+            memmove(dst + i*stride, src + i*stride, w*3);
+    }
+}
+
+// Fills a w x h rectangle at (x, y) with color (0xRRGGBB). Only the first
+// pixel is stored byte by byte, the rest of the first row is built by
+// doubling memcpys and the remaining rows are copies of the first row.
+static void
+fill_rect(unsigned char *frame, int width, int x, int y, int w, int h,
+    unsigned int color)
+{
+    if (w == 0 || h == 0)
+        return;
+
+    int stride = width*3;
+    int row_len = w*3;
+    unsigned char *row = frame + y*stride + x*3;
+
+    row[0] = (color >> 16) & 0xFF;
+    row[1] = (color >> 8) & 0xFF;
+    row[2] = color & 0xFF;
+
+    int filled = 3;
+    while (filled < row_len) {
+        int n = filled < row_len - filled ? filled : row_len - filled;
+        memcpy(row + filled, row, n);
+        filled += n;
+    }
+
+    for (int i = 1; i < h; i++)
+        memcpy(row + i*stride, row, row_len);
+}
+
 StackedVideo::StackedVideo(int wwidth, int hheight) :
     width(wwidth), height(hheight), videoEncoder(wwidth, hheight),
-    lastFrame(NULL), lastTimeStamp(0) {}
+    lastFrame(NULL), lastTimeStamp(0), frameCount(0),
+    changeMap(wwidth, hheight), lastChangeMap(wwidth, hheight),
+    changeMapFile(NULL) {}
 
 StackedVideo::~StackedVideo()
 {
     free(lastFrame);
+    if (changeMapFile) fclose(changeMapFile);
+    segmentCallback.Dispose();
 }
 
 void
@@ -25,11 +81,29 @@ StackedVideo::Initialize(Handle<Object> target)
     t->InstanceTemplate()->SetInternalFieldCount(1);
     NODE_SET_PROTOTYPE_METHOD(t, "newFrame", NewFrame);
     NODE_SET_PROTOTYPE_METHOD(t, "push", Push);
+    NODE_SET_PROTOTYPE_METHOD(t, "pushMany", PushMany);
+    NODE_SET_PROTOTYPE_METHOD(t, "copyRect", CopyRect);
+    NODE_SET_PROTOTYPE_METHOD(t, "fillRect", FillRect);
     NODE_SET_PROTOTYPE_METHOD(t, "endPush", EndPush);
     NODE_SET_PROTOTYPE_METHOD(t, "setOutputFile", SetOutputFile);
     NODE_SET_PROTOTYPE_METHOD(t, "setQuality", SetQuality);
+    NODE_SET_PROTOTYPE_METHOD(t, "setBitrate", SetBitrate);
+    NODE_SET_PROTOTYPE_METHOD(t, "setSpeed", SetSpeed);
+    NODE_SET_PROTOTYPE_METHOD(t, "setAutoSpeed", SetAutoSpeed);
+    NODE_SET_PROTOTYPE_METHOD(t, "setGovernor", SetGovernor);
+    NODE_SET_PROTOTYPE_METHOD(t, "stats", Stats);
     NODE_SET_PROTOTYPE_METHOD(t, "setFrameRate", SetFrameRate);
     NODE_SET_PROTOTYPE_METHOD(t, "setKeyFrameInterval", SetKeyFrameInterval);
+    NODE_SET_PROTOTYPE_METHOD(t, "forceKeyframe", ForceKeyframe);
+    NODE_SET_PROTOTYPE_METHOD(t, "setMaxKeyFrameInterval", SetMaxKeyFrameInterval);
+    NODE_SET_PROTOTYPE_METHOD(t, "setSceneChangeThreshold", SetSceneChangeThreshold);
+    NODE_SET_PROTOTYPE_METHOD(t, "setCrop", SetCrop);
+    NODE_SET_PROTOTYPE_METHOD(t, "setSegments", SetSegments);
+    NODE_SET_PROTOTYPE_METHOD(t, "setRingBuffer", SetRingBuffer);
+    NODE_SET_PROTOTYPE_METHOD(t, "dumpRing", DumpRing);
+    NODE_SET_PROTOTYPE_METHOD(t, "setChangeMapFile", SetChangeMapFile);
+    NODE_SET_PROTOTYPE_METHOD(t, "changeMap", ChangeMapBuffer);
+    NODE_SET_PROTOTYPE_METHOD(t, "prepare", Prepare);
     NODE_SET_PROTOTYPE_METHOD(t, "end", End);
     target->Set(String::NewSymbol("StackedVideo"), t->GetFunction());
 }
@@ -51,7 +125,8 @@ StackedVideo::NewFrame(const unsigned char *data, unsigned long timeStamp)
     videoEncoder.newFrame(data);
 
     memcpy(lastFrame, data, width*height*3);
-    lastTimeStamp = timeStamp;
+    changeMap.markAll();
+    FrameDone(timeStamp);
 
     return Undefined();
 }
@@ -67,12 +142,72 @@ StackedVideo::Push(unsigned char *rect, int x, int y, int w, int h)
            if (!lastFrame) 
                return VException("malloc failed in StackedVideo::Push.");
            memcpy(lastFrame, rect, width*height*3);
+           changeMap.markAll();
            return Undefined();
         }
         return VException("The first full frame was not pushed.");
     }
 
     updates.push_back(Update(rect, x, y, w, h));
+    changeMap.mark(x, y, w, h);
+
+    return Undefined();
+}
+
+Handle<Value>
+StackedVideo::PushMany(unsigned char *buf, const RectList &rects)
+{
+    HandleScope scope;
+
+    const int32_t *r = rects.rects;
+
+    if (!lastFrame && rects.count > 0 &&
+        !(r[0]==0 && r[1]==0 && r[2]==width && r[3]==height))
+    {
+        return VException("The first full frame was not pushed.");
+    }
+
+    // Push reports failures as JS exceptions. Stop at the first one and drop
+    // the rectangles of this call that were already queued.
+    TryCatch try_catch;
+    size_t queued = updates.size();
+
+    updates.reserve(updates.size() + rects.count);
+    for (int i = 0; i < rects.count; i++, r += 5) {
+        Push(buf + r[4], r[0], r[1], r[2], r[3]);
+        if (try_catch.HasCaught()) {
+            updates.erase(updates.begin() + queued, updates.end());
+            return try_catch.ReThrow();
+        }
+    }
+
+    return Undefined();
+}
+
+Handle<Value>
+StackedVideo::CopyRect(int srcX, int srcY, int dstX, int dstY, int w, int h)
+{
+    HandleScope scope;
+
+    if (!lastFrame)
+        return VException("The first full frame was not pushed.");
+
+    updates.push_back(Update(srcX, srcY, dstX, dstY, w, h));
+    changeMap.mark(dstX, dstY, w, h);
+
+    return Undefined();
+}
+
+Handle<Value>
+StackedVideo::FillRect(int x, int y, int w, int h, unsigned int color)
+{
+    HandleScope scope;
+
+    if (!lastFrame)
+        return VException("The first full frame was not pushed.");
+
+    updates.push_back(Update(x, y, w, h, color));
+    changeMap.mark(x, y, w, h);
 
     return Undefined();
 }
@@ -94,6 +229,17 @@ StackedVideo::EndPush(unsigned long timeStamp)
     {
         const Update &update = *it;
 
+        if (update.type == Update::COPY) {
+            copy_rect(lastFrame, width, update.srcX, update.srcY,
+                update.x, update.y, update.w, update.h);
+            continue;
+        }
+        if (update.type == Update::FILL) {
+            fill_rect(lastFrame, width, update.x, update.y,
+                update.w, update.h, update.color);
+            continue;
+        }
+
         int start = (update.y)*width*3 + (update.x)*3;
         const unsigned char *updatep = &(update.rect[0]);
         for (int i = 0; i < update.h; i++) {
@@ -107,13 +253,34 @@ StackedVideo::EndPush(unsigned long timeStamp)
     }
     updates.clear();
 
+    if (changeMap.size() > 0)
+        videoEncoder.frameChanged((double)changeMap.changedBlocks()/changeMap.size());
     videoEncoder.newFrame(lastFrame);
 
-    lastTimeStamp = timeStamp;
+    FrameDone(timeStamp);
 
     return Undefined();
 }
 
+void
+StackedVideo::FrameDone(unsigned long timeStamp)
+{
+    if (changeMapFile) {
+        // each record is: uint32 frame number, uint64 timestamp, change map
+        uint32_t frame = frameCount;
+        uint64_t ts = timeStamp;
+        fwrite(&frame, sizeof(frame), 1, changeMapFile);
+        fwrite(&ts, sizeof(ts), 1, changeMapFile);
+        fwrite(changeMap.data(), 1, changeMap.size(), changeMapFile);
+    }
+
+    lastChangeMap = changeMap;
+    changeMap.clear();
+
+    lastTimeStamp = timeStamp;
+    frameCount++;
+}
+
 void
 StackedVideo::SetOutputFile(const char *fileName)
 {
@@ -126,6 +293,30 @@ StackedVideo::SetQuality(int quality)
     videoEncoder.setQuality(quality);
 }
 
+void
+StackedVideo::SetBitrate(int bitrate, int bufferDelay, int flags)
+{
+    videoEncoder.setBitrate(bitrate, bufferDelay, flags);
+}
+
+void
+StackedVideo::SetSpeed(int speed)
+{
+    videoEncoder.setSpeed(speed);
+}
+
+void
+StackedVideo::SetAutoSpeed(bool enabled)
+{
+    videoEncoder.setAutoSpeed(enabled);
+}
+
+void
+StackedVideo::SetGovernor(bool enabled)
+{
+    videoEncoder.setGovernor(enabled);
+}
+
 void
 StackedVideo::SetFrameRate(int frameRate)
 {
@@ -138,12 +329,112 @@ StackedVideo::SetKeyFrameInterval(int keyFrameInterval)
     videoEncoder.setKeyFrameInterval(keyFrameInterval);
 }
 
+void
+StackedVideo::SetMaxKeyFrameInterval(int interval)
+{
+    videoEncoder.setMaxKeyFrameInterval(interval);
+}
+
+void
+StackedVideo::SetSceneChangeThreshold(double threshold)
+{
+    videoEncoder.setSceneChangeThreshold(threshold);
+}
+
+void
+StackedVideo::ForceKeyframe()
+{
+    videoEncoder.forceKeyframe();
+}
+
+void
+StackedVideo::SetSegments(double seconds, unsigned long long bytes)
+{
+    videoEncoder.setSegments(seconds, bytes);
+}
+
+void
+StackedVideo::SetRingBuffer(double seconds, unsigned long long bytes)
+{
+    videoEncoder.setRingBuffer(seconds, bytes);
+}
+
+void
+StackedVideo::DumpRing(const char *fileName, double &duration, unsigned long long &bytes)
+{
+    videoEncoder.dumpRing(fileName, duration, bytes);
+}
+
+void
+StackedVideo::SetCrop(int x, int y, int w, int h)
+{
+    videoEncoder.setCrop(x, y, w, h);
+}
+
+Handle<Value>
+StackedVideo::SetChangeMapFile(const char *fileName)
+{
+    HandleScope scope;
+
+    if (changeMapFile) fclose(changeMapFile);
+
+    changeMapFile = fopen(fileName, "w+");
+    if (!changeMapFile) {
+        char error_msg[256];
+        snprintf(error_msg, 256, "Could not open %s. Error: %s.",
+            fileName, strerror(errno));
+        return VException(error_msg);
+    }
+
+    // header is: "CMAP", uint32 blocks per row, uint32 blocks per column
+    uint32_t dims[2] = { (uint32_t)changeMap.width(), (uint32_t)changeMap.height() };
+    fwrite("CMAP", 1, 4, changeMapFile);
+    fwrite(dims, sizeof(dims[0]), 2, changeMapFile);
+
+    return Undefined();
+}
+
+Handle<Value>
+StackedVideo::ChangeMapBuffer()
+{
+    HandleScope scope;
+
+    Buffer *buf = Buffer::New(lastChangeMap.size());
+#if NODE_VERSION_AT_LEAST(0,3,0)
+    memcpy(Buffer::Data(buf->handle_), lastChangeMap.data(), lastChangeMap.size());
+#else
+    memcpy(buf->data(), lastChangeMap.data(), lastChangeMap.size());
+#endif
+
+    return scope.Close(buf->handle_);
+}
+
+void
+StackedVideo::Prepare()
+{
+    videoEncoder.prepare();
+}
+
 void
 StackedVideo::End()
 {
     videoEncoder.end();
+    if (changeMapFile) fclose(changeMapFile);
+    changeMapFile = NULL;
 }
 
+// Tells the segment callback about segments finished since the last call.
+void
+StackedVideo::NotifySegments()
+{
+    std::vector<SegmentInfo> segments;
+    videoEncoder.takeClosedSegments(segments);
+    if (!segmentCallback.IsEmpty())
+        call_segment_callback(segmentCallback, segments);
+}
+
+
+
 Handle<Value>
 StackedVideo::New(const Arguments &args)
 {
@@ -199,11 +490,17 @@ StackedVideo::NewFrame(const Arguments &args)
 
     StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
 
+    try {
 #if NODE_VERSION_AT_LEAST(0,3,0)
-    sv->NewFrame((unsigned char *) Buffer::Data(rgb), timeStamp);
+        sv->NewFrame((unsigned char *) Buffer::Data(rgb), timeStamp);
 #else
-    sv->NewFrame((unsigned char *)rgb->data(), timeStamp);
+        sv->NewFrame((unsigned char *)rgb->data(), timeStamp);
 #endif
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+    sv->NotifySegments();
 
     return Undefined();
 }
@@ -264,6 +561,123 @@ StackedVideo::Push(const Arguments &args)
     return Undefined();
 }
 
+Handle<Value>
+StackedVideo::PushMany(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 2)
+        return VException("Two arguments required - buffer, rectangles.");
+
+    if (!Buffer::HasInstance(args[0]))
+        return VException("First argument must be Buffer.");
+
+    RectList rects;
+    if (!rect_list_from_value(args[1], rects))
+        return VException("Second argument must be Int32Array, Buffer or Array of (x, y, width, height, offset) tuples.");
+
+    StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
+#if NODE_VERSION_AT_LEAST(0,3,0)
+    v8::Handle<v8::Object> rgb = args[0]->ToObject();
+    unsigned char *data = (unsigned char *) Buffer::Data(rgb);
+    size_t length = Buffer::Length(rgb);
+#else
+    Buffer *rgb = ObjectWrap::Unwrap<Buffer>(args[0]->ToObject());
+    unsigned char *data = (unsigned char *)rgb->data();
+    size_t length = rgb->length();
+#endif
+
+    char error[256];
+    if (!check_rect_list(rects, length, sv->width, sv->height, error, sizeof(error)))
+        return VException(error);
+
+    try {
+        return sv->PushMany(data, rects);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+}
+
+Handle<Value>
+StackedVideo::CopyRect(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 6)
+        return VException("Six arguments required - srcX, srcY, dstX, dstY, width, height.");
+
+    for (int i = 0; i < 6; i++) {
+        if (!args[i]->IsInt32())
+            return VException("All arguments must be integers.");
+    }
+
+    StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
+    int srcX = args[0]->Int32Value();
+    int srcY = args[1]->Int32Value();
+    int dstX = args[2]->Int32Value();
+    int dstY = args[3]->Int32Value();
+    int w = args[4]->Int32Value();
+    int h = args[5]->Int32Value();
+
+    if (srcX < 0 || srcY < 0 || dstX < 0 || dstY < 0)
+        return VException("Coordinates smaller than 0.");
+    if (w < 0)
+        return VException("Width smaller than 0.");
+    if (h < 0)
+        return VException("Height smaller than 0.");
+    if (srcX+w > sv->width || dstX+w > sv->width)
+        return VException("Copied rectangle exceeds StackedVideo's width.");
+    if (srcY+h > sv->height || dstY+h > sv->height)
+        return VException("Copied rectangle exceeds StackedVideo's height.");
+
+    return sv->CopyRect(srcX, srcY, dstX, dstY, w, h);
+}
+
+Handle<Value>
+StackedVideo::FillRect(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 5)
+        return VException("Five arguments required - x, y, width, height, color.");
+
+    if (!args[0]->IsInt32())
+        return VException("First argument must be integer x.");
+    if (!args[1]->IsInt32())
+        return VException("Second argument must be integer y.");
+    if (!args[2]->IsInt32())
+        return VException("Third argument must be integer width.");
+    if (!args[3]->IsInt32())
+        return VException("Fourth argument must be integer height.");
+    if (!args[4]->IsUint32())
+        return VException("Fifth argument must be integer color (0xRRGGBB).");
+
+    StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
+    int x = args[0]->Int32Value();
+    int y = args[1]->Int32Value();
+    int w = args[2]->Int32Value();
+    int h = args[3]->Int32Value();
+    unsigned int color = args[4]->Uint32Value();
+
+    if (x < 0)
+        return VException("Coordinate x smaller than 0.");
+    if (y < 0)
+        return VException("Coordinate y smaller than 0.");
+    if (w < 0)
+        return VException("Width smaller than 0.");
+    if (h < 0)
+        return VException("Height smaller than 0.");
+    if (color > 0xFFFFFF)
+        return VException("Color greater than 0xFFFFFF.");
+    if (x+w > sv->width)
+        return VException("Filled rectangle exceeds StackedVideo's width.");
+    if (y+h > sv->height)
+        return VException("Filled rectangle exceeds StackedVideo's height.");
+
+    return sv->FillRect(x, y, w, h, color);
+}
+
 Handle<Value>
 StackedVideo::EndPush(const Arguments &args)
 {
@@ -282,7 +696,13 @@ StackedVideo::EndPush(const Arguments &args)
     }
 
     StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
-    sv->EndPush(timeStamp);
+    try {
+        sv->EndPush(timeStamp);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+    sv->NotifySegments();
 
     return Undefined();
 }
@@ -325,6 +745,102 @@ StackedVideo::SetQuality(const Arguments &args)
     return Undefined();
 }
 
+Handle<Value>
+StackedVideo::SetBitrate(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1)
+        return VException("At least one argument required - bitrate in bits per second.");
+
+    if (!args[0]->IsInt32())
+        return VException("Bitrate must be integer.");
+
+    int bitrate = args[0]->Int32Value();
+
+    if (bitrate < 0) return VException("Bitrate smaller than 0.");
+
+    int bufferDelay, flags;
+    const char *error = rate_options_from_value(args[1], bufferDelay, flags);
+    if (error)
+        return VException(error);
+
+    StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
+    try {
+        sv->SetBitrate(bitrate, bufferDelay, flags);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+
+    return Undefined();
+}
+
+Handle<Value>
+StackedVideo::SetSpeed(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - encoder speed level.");
+
+    if (!args[0]->IsInt32())
+        return VException("Speed level must be integer.");
+
+    int speed = args[0]->Int32Value();
+
+    if (speed < 0) return VException("Speed level smaller than 0.");
+
+    StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
+    sv->SetSpeed(speed);
+
+    return Undefined();
+}
+
+Handle<Value>
+StackedVideo::SetAutoSpeed(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - true or false.");
+
+    if (!args[0]->IsBoolean())
+        return VException("First argument must be boolean.");
+
+    StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
+    sv->SetAutoSpeed(args[0]->BooleanValue());
+
+    return Undefined();
+}
+
+Handle<Value>
+StackedVideo::SetGovernor(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - true or false.");
+
+    if (!args[0]->IsBoolean())
+        return VException("First argument must be boolean.");
+
+    StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
+    sv->SetGovernor(args[0]->BooleanValue());
+
+    return Undefined();
+}
+
+Handle<Value>
+StackedVideo::Stats(const Arguments &args)
+{
+    HandleScope scope;
+
+    StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
+
+    return scope.Close(encoder_stats_object(sv->videoEncoder.getStats()));
+}
+
 Handle<Value>
 StackedVideo::SetFrameRate(const Arguments &args)
 {
@@ -338,6 +854,9 @@ StackedVideo::SetFrameRate(const Arguments &args)
 
     int rate = args[0]->Int32Value();
 
+    if (rate < 1)
+        return VException("Frame rate must be positive.");
+
     StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
     sv->SetFrameRate(rate);
 
@@ -357,18 +876,249 @@ StackedVideo::SetKeyFrameInterval(const Arguments &args)
 
     int interval = args[0]->Int32Value();
 
-    if (interval < 0)
+    if (interval < 1)
         return VException("Keyframe interval must be positive.");
 
-    if ((interval & (interval - 1)) != 0)
-        return VException("Keyframe interval must be a power of two.");
-
     StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
     sv->SetKeyFrameInterval(interval);
 
     return Undefined();
 }
 
+Handle<Value>
+StackedVideo::SetChangeMapFile(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - change map file name.");
+
+    if (!args[0]->IsString())
+        return VException("First argument must be string.");
+
+    String::AsciiValue fileName(args[0]->ToString());
+
+    StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
+    return sv->SetChangeMapFile(*fileName);
+}
+
+Handle<Value>
+StackedVideo::ChangeMapBuffer(const Arguments &args)
+{
+    HandleScope scope;
+
+    StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
+    return scope.Close(sv->ChangeMapBuffer());
+}
+
+Handle<Value>
+StackedVideo::SetMaxKeyFrameInterval(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - max keyframe interval.");
+
+    if (!args[0]->IsInt32())
+        return VException("Max keyframe interval must be integer.");
+
+    int interval = args[0]->Int32Value();
+
+    if (interval < 0)
+        return VException("Max keyframe interval must be positive.");
+
+    StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
+    sv->SetMaxKeyFrameInterval(interval);
+
+    return Undefined();
+}
+
+Handle<Value>
+StackedVideo::SetSceneChangeThreshold(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - changed fraction of the frame.");
+
+    if (!args[0]->IsNumber())
+        return VException("Scene change threshold must be a number.");
+
+    double threshold = args[0]->NumberValue();
+
+    if (threshold < 0 || threshold > 1)
+        return VException("Scene change threshold must be between 0 and 1.");
+
+    StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
+    sv->SetSceneChangeThreshold(threshold);
+
+    return Undefined();
+}
+
+Handle<Value>
+StackedVideo::ForceKeyframe(const Arguments &args)
+{
+    HandleScope scope;
+
+    StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
+    sv->ForceKeyframe();
+
+    return Undefined();
+}
+
+Handle<Value>
+StackedVideo::SetSegments(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1)
+        return VException("At least one argument required - segment options.");
+
+    if (args.Length() > 1 && !args[1]->IsFunction())
+        return VException("Second argument must be a function.");
+
+    double seconds;
+    unsigned long long bytes;
+    const char *error = limit_options_from_value(args[0], seconds, bytes);
+    if (error)
+        return VException(error);
+
+    StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
+    try {
+        sv->SetSegments(seconds, bytes);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+
+    if (!sv->segmentCallback.IsEmpty()) {
+        sv->segmentCallback.Dispose();
+        sv->segmentCallback.Clear();
+    }
+    if (args.Length() > 1)
+        sv->segmentCallback = Persistent<Function>::New(Local<Function>::Cast(args[1]));
+
+    return Undefined();
+}
+
+Handle<Value>
+StackedVideo::SetRingBuffer(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - ring buffer options.");
+
+    double seconds;
+    unsigned long long bytes;
+    const char *error = limit_options_from_value(args[0], seconds, bytes);
+    if (error)
+        return VException(error);
+
+    StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
+    try {
+        sv->SetRingBuffer(seconds, bytes);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+
+    return Undefined();
+}
+
+Handle<Value>
+StackedVideo::DumpRing(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - output file name.");
+
+    if (!args[0]->IsString())
+        return VException("First argument must be string.");
+
+    String::AsciiValue fileName(args[0]->ToString());
+
+    StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
+
+    double duration;
+    unsigned long long bytes;
+    try {
+        sv->DumpRing(*fileName, duration, bytes);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+
+    Local<Object> result = Object::New();
+    result->Set(String::New("duration"), Number::New(duration));
+    result->Set(String::New("bytes"), Number::New(bytes));
+    return scope.Close(result);
+}
+
+Handle<Value>
+StackedVideo::SetCrop(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 4)
+        return VException("Four arguments required - x, y, width, height.");
+
+    if (!args[0]->IsInt32())
+        return VException("First argument must be integer x.");
+    if (!args[1]->IsInt32())
+        return VException("Second argument must be integer y.");
+    if (!args[2]->IsInt32())
+        return VException("Third argument must be integer width.");
+    if (!args[3]->IsInt32())
+        return VException("Fourth argument must be integer height.");
+
+    StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
+    int x = args[0]->Int32Value();
+    int y = args[1]->Int32Value();
+    int w = args[2]->Int32Value();
+    int h = args[3]->Int32Value();
+
+    if (x < 0)
+        return VException("Coordinate x smaller than 0.");
+    if (y < 0)
+        return VException("Coordinate y smaller than 0.");
+    if (w <= 0)
+        return VException("Width must be positive.");
+    if (h <= 0)
+        return VException("Height must be positive.");
+    if (x+w > sv->width)
+        return VException("Crop rectangle exceeds StackedVideo's width.");
+    if (y+h > sv->height)
+        return VException("Crop rectangle exceeds StackedVideo's height.");
+
+    try {
+        sv->SetCrop(x, y, w, h);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+
+    return Undefined();
+}
+
+Handle<Value>
+StackedVideo::Prepare(const Arguments &args)
+{
+    HandleScope scope;
+
+    StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
+
+    try {
+        sv->Prepare();
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+
+    return Undefined();
+}
+
 Handle<Value>
 StackedVideo::End(const Arguments &args)
 {
@@ -376,6 +1126,7 @@ StackedVideo::End(const Arguments &args)
 
     StackedVideo *sv = ObjectWrap::Unwrap<StackedVideo>(args.This());
     sv->End();
+    sv->NotifySegments();
 
     return Undefined();
 }
@@ -2,8 +2,11 @@
 #define STACKED_VIDEO_H
 
 #include <vector>
+#include <cstdio>
 #include <node.h>
+#include "common.h"
 #include "video_encoder.h"
+#include "change_map.h"
 
 class StackedVideo : public node::ObjectWrap {
     int width, height;
@@ -11,41 +14,96 @@ class StackedVideo : public node::ObjectWrap {
     VideoEncoder videoEncoder;
     unsigned char *lastFrame;
     unsigned long lastTimeStamp;
+    unsigned long frameCount;
+
+    ChangeMap changeMap, lastChangeMap;
+    FILE *changeMapFile;
+
+    v8::Persistent<v8::Function> segmentCallback;
 
     struct Update {
+        enum Type { PUSH, COPY, FILL };
+        Type type;
         int x, y, w, h;
+        int srcX, srcY; // COPY only
+        unsigned int color; // FILL only, 0xRRGGBB
         typedef std::vector<unsigned char> Rect;
         Rect rect;
         Update(unsigned char *rrect, int xx, int yy, int ww, int hh) :
-            rect(rrect, rrect+(ww*hh*3)), x(xx), y(yy), w(ww), h(hh) {}
+            type(PUSH), x(xx), y(yy), w(ww), h(hh), srcX(0), srcY(0), color(0),
+            rect(rrect, rrect+(ww*hh*3)) {}
+        Update(int ssrcX, int ssrcY, int xx, int yy, int ww, int hh) :
+            type(COPY), x(xx), y(yy), w(ww), h(hh), srcX(ssrcX), srcY(ssrcY),
+            color(0) {}
+        Update(int xx, int yy, int ww, int hh, unsigned int ccolor) :
+            type(FILL), x(xx), y(yy), w(ww), h(hh), srcX(0), srcY(0),
+            color(ccolor) {}
     };
 
     typedef std::vector<Update> VectorUpdate;
     typedef VectorUpdate::iterator VectorUpdateIterator;
     VectorUpdate updates;
 
+    void FrameDone(unsigned long timeStamp);
+
 public:
     StackedVideo(int wwidth, int hheight);
     ~StackedVideo();
     static void Initialize(v8::Handle<v8::Object> target);
     v8::Handle<v8::Value> NewFrame(const unsigned char *data, unsigned long timeStamp=0);
     v8::Handle<v8::Value> Push(unsigned char *rect, int x, int y, int w, int h);
+    v8::Handle<v8::Value> PushMany(unsigned char *buf, const RectList &rects);
+    v8::Handle<v8::Value> CopyRect(int srcX, int srcY, int dstX, int dstY, int w, int h);
+    v8::Handle<v8::Value> FillRect(int x, int y, int w, int h, unsigned int color);
     v8::Handle<v8::Value> EndPush(unsigned long timeStamp=0);
     void SetOutputFile(const char *fileName);
     void SetQuality(int quality);
+    void SetBitrate(int bitrate, int bufferDelay, int flags);
+    void SetSpeed(int speed);
+    void SetAutoSpeed(bool enabled);
+    void SetGovernor(bool enabled);
     void SetFrameRate(int frameRate);
     void SetKeyFrameInterval(int keyFrameInterval);
+    void ForceKeyframe();
+    void SetMaxKeyFrameInterval(int interval);
+    void SetSceneChangeThreshold(double threshold);
+    void SetCrop(int x, int y, int w, int h);
+    void SetSegments(double seconds, unsigned long long bytes);
+    void SetRingBuffer(double seconds, unsigned long long bytes);
+    void DumpRing(const char *fileName, double &duration, unsigned long long &bytes);
+    v8::Handle<v8::Value> SetChangeMapFile(const char *fileName);
+    v8::Handle<v8::Value> ChangeMapBuffer();
+    void Prepare();
     void End();
+    void NotifySegments();
 
 protected:
     static v8::Handle<v8::Value> New(const v8::Arguments &args);
     static v8::Handle<v8::Value> NewFrame(const v8::Arguments &args);
     static v8::Handle<v8::Value> Push(const v8::Arguments &args);
+    static v8::Handle<v8::Value> PushMany(const v8::Arguments &args);
+    static v8::Handle<v8::Value> CopyRect(const v8::Arguments &args);
+    static v8::Handle<v8::Value> FillRect(const v8::Arguments &args);
     static v8::Handle<v8::Value> EndPush(const v8::Arguments &args);
     static v8::Handle<v8::Value> SetOutputFile(const v8::Arguments &args);
     static v8::Handle<v8::Value> SetQuality(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetBitrate(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetSpeed(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetAutoSpeed(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetGovernor(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Stats(const v8::Arguments &args);
     static v8::Handle<v8::Value> SetFrameRate(const v8::Arguments &args);
     static v8::Handle<v8::Value> SetKeyFrameInterval(const v8::Arguments &args);
+    static v8::Handle<v8::Value> ForceKeyframe(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetMaxKeyFrameInterval(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetSceneChangeThreshold(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetCrop(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetSegments(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetRingBuffer(const v8::Arguments &args);
+    static v8::Handle<v8::Value> DumpRing(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetChangeMapFile(const v8::Arguments &args);
+    static v8::Handle<v8::Value> ChangeMapBuffer(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Prepare(const v8::Arguments &args);
     static v8::Handle<v8::Value> End(const v8::Arguments &args);
 };
 
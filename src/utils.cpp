@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #include "common.h"
@@ -103,3 +104,12 @@ is_dir(const char *path)
     return S_ISDIR(moo.st_mode);
 }
 
+// Seconds since the epoch, with microsecond resolution.
+double
+wall_time()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
@@ -9,5 +9,7 @@ char **filter_file_list(char **file_list, int (*f)(const char *file));
 int file_size(const char *path);
 bool is_dir(const char *path);
 
+double wall_time();
+
 #endif
 
@@ -6,13 +6,26 @@
 #include "loki/ScopeGuard.h"
 
 #include "common.h"
+#include "utils.h"
 #include "video_encoder.h"
+#include "encoder_pool.h"
 
 using namespace v8;
 using namespace node;
 
 static int chroma_format = TH_PF_420;
 
+// the governor holds each degradation level for at least this many frames
+static const int GOVERNOR_HOLD_FRAMES = 25;
+// after speed, the governor lowers quality this many times by QUALITY_STEP,
+// then encodes only every 2nd, 3rd, ... up to (DECIMATION_STEPS+1)th frame
+static const int QUALITY_STEPS = 3;
+static const int QUALITY_STEP = 8;
+static const int DECIMATION_STEPS = 3;
+// frames with less than this fraction changed count as idle for stretching
+// keyframe spacing
+static const double IDLE_CHANGE = 0.01;
+
 static inline unsigned char
 yuv_clamp(double d)
 {
@@ -22,55 +35,174 @@ yuv_clamp(double d)
     return d;
 }
 
-static unsigned char *
-rgb_to_yuv(const unsigned char *rgb, size_t size)
+static inline unsigned char
+rgb_y(unsigned char r, unsigned char g, unsigned char b)
+{
+    return yuv_clamp(0.299 * r + 0.587 * g + 0.114 * b);
+}
+
+static inline unsigned char
+rgb_u(unsigned char r, unsigned char g, unsigned char b)
+{
+    return yuv_clamp((0.436 * 255 - 0.14713 * r - 0.28886 * g + 0.436 * b) / 0.872);
+}
+
+static inline unsigned char
+rgb_v(unsigned char r, unsigned char g, unsigned char b)
+{
+    return yuv_clamp((0.615 * 255 + 0.615 * r - 0.51499 * g - 0.10001 * b) / 1.230);
+}
+
+// Converts w x h rgb pixels (rows stride bytes apart) straight into the
+// planes of ycbcr, placing the picture at (pic_x, pic_y). Chroma is only
+// computed for the pixels that are sampled.
+static void
+rgb_to_ycbcr(const unsigned char *rgb, int stride, int w, int h,
+    th_ycbcr_buffer ycbcr, int pic_x, int pic_y)
 {
-    unsigned char r, g, b;
-    unsigned char *yuv = (unsigned char *)malloc(size);
-    if (!yuv) return NULL;
+    int xdec = (chroma_format != TH_PF_444);
+    int ydec = (chroma_format == TH_PF_420);
 
-    for (size_t i=0; i<size; i+=3) {
-        r = rgb[i];
-        g = rgb[i+1];
-        b = rgb[i+2];
+    for (int y = 0; y < h; y++) {
+        const unsigned char *src = rgb + y*stride;
+        unsigned char *dst = ycbcr[0].data + (pic_y + y)*ycbcr[0].stride + pic_x;
+        for (int x = 0; x < w; x++, src += 3)
+            dst[x] = rgb_y(src[0], src[1], src[2]);
+    }
 
-        yuv[i] = yuv_clamp(0.299 * r + 0.587 * g + 0.114 * b);
-        yuv[i+1] = yuv_clamp((0.436 * 255 - 0.14713 * r - 0.28886 * g + 0.436 * b) / 0.872);
-        yuv[i+2] = yuv_clamp((0.615 * 255 + 0.615 * r - 0.51499 * g - 0.10001 * b) / 1.230);
+    int cw = (w + xdec) >> xdec;
+    int ch = (h + ydec) >> ydec;
+    for (int y = 0; y < ch; y++) {
+        const unsigned char *src = rgb + (y << ydec)*stride;
+        int offset = ((pic_y >> ydec) + y)*ycbcr[1].stride + (pic_x >> xdec);
+        unsigned char *dst_u = ycbcr[1].data + offset;
+        unsigned char *dst_v = ycbcr[2].data + offset;
+        for (int x = 0; x < cw; x++, src += 3 << xdec) {
+            dst_u[x] = rgb_u(src[0], src[1], src[2]);
+            dst_v[x] = rgb_v(src[0], src[1], src[2]);
+        }
     }
+}
+
+// Fills the area of plane outside of the picture (x, y, w, h) by repeating
+// picture's edge pixels, so the padding costs (almost) no bits.
+static void
+pad_plane(th_img_plane &plane, int x, int y, int w, int h)
+{
+    if (w <= 0 || h <= 0)
+        return;
 
-    return yuv;
+    for (int i = y; i < y + h; i++) {
+        unsigned char *row = plane.data + i*plane.stride;
+        memset(row, row[x], x);
+        memset(row + x + w, row[x + w - 1], plane.width - x - w);
+    }
+    for (int i = 0; i < y; i++)
+        memcpy(plane.data + i*plane.stride, plane.data + y*plane.stride, plane.width);
+    for (int i = y + h; i < plane.height; i++)
+        memcpy(plane.data + i*plane.stride, plane.data + (y + h - 1)*plane.stride, plane.width);
 }
 
 VideoEncoder::VideoEncoder(int wwidth, int hheight) :
     width(wwidth), height(hheight), quality(31), frameRate(25),
     keyFrameInterval(64),
-    ogg_fp(NULL), td(NULL), ogg_os(NULL),
-    frameCount(0) {}
+    bitrate(0), rateBuffer(0),
+    rateFlags(TH_RATECTL_DROP_FRAMES|TH_RATECTL_CAP_OVERFLOW),
+    cropX(0), cropY(0), cropWidth(wwidth), cropHeight(hheight),
+    stride(wwidth*3),
+    ogg_fp(NULL), td(NULL), ogg_os(NULL), picX(0), picY(0),
+    frameCount(0), bytesWritten(0),
+    speed(0), speedLevel(0), maxSpeed(0), settingsChanged(false), rateChanged(false),
+    governor(GOVERNOR_OFF), degradation(0), qualityLevel(31),
+    decimation(1), skipFrames(0), encodeLoad(0), framesSinceChange(0),
+    pass(0), passDataPos(0), passHeaderSize(0),
+    sceneChangeThreshold(0), changeFraction(1), maxKeyFrameInterval(0),
+    keyFrameForce(0), keyframePending(false), keyFrameShift(0),
+    inputRate(25), frameDebt(0),
+    segmentSeconds(0), segmentBytes(0), segmentIndex(0), segmentFrames(0),
+    segmentStart(0), ringSeconds(0), ringBytes(0), ringUsed(0), ringKeyframes(0)
+{
+    memset(ycbcr, 0, sizeof(ycbcr));
+}
 
 VideoEncoder::~VideoEncoder() {
-    end();
+    // a first pass that wasn't ended has no use for its summary
+    try {
+        end();
+    }
+    catch (const char *) {
+    }
 }
 
+// Opens the output file, sets up the encoder and writes the headers, which
+// otherwise happens on the first frame. All the settings that can only be
+// set before the first frame must be set by then.
 void
-VideoEncoder::newFrame(const unsigned char *data)
+VideoEncoder::prepare()
 {
-    if (!frameCount) {
-        if (outputFileName.empty())
-            throw "No output means was set. Use setOutputFile to set it.";
+    if (td)
+        return;
 
-        ogg_fp = fopen(outputFileName.c_str(), "w+");
+    if (outputFileName.empty() && !Ring())
+        throw "No output means was set. Use setOutputFile to set it.";
+
+    segmentPath = Segmented() ? SegmentPath(segmentIndex) : outputFileName;
+    segmentFrames = 0;
+    segmentStart = bytesWritten;
+
+    // the first pass and the ring buffer don't write any video
+    if (pass != 1 && !Ring()) {
+        ogg_fp = fopen(segmentPath.c_str(), "w+");
         if (!ogg_fp) {
             char error_msg[256];
             snprintf(error_msg, 256, "Could not open %s. Error: %s.",
-                outputFileName.c_str(), strerror(errno));
-            throw error_msg;
+                segmentPath.c_str(), strerror(errno));
+            errorMessage = error_msg;
+            throw errorMessage.c_str();
         }
+    }
+
+    InitTheora();
+    WriteHeaders();
+}
 
-        InitTheora();
-        WriteHeaders();
+// Allocates count encoder contexts for videos with this encoder's size,
+// frame rate and keyframe intervals into encoder_pool. Returns how many were
+// allocated.
+int
+VideoEncoder::preallocate(int count)
+{
+    th_info info;
+    FillInfo(info);
+    int allocated = encoder_pool.fill(info, count);
+    th_info_clear(&info);
+    return allocated;
+}
+
+void
+VideoEncoder::newFrame(const unsigned char *data)
+{
+    prepare();
+
+    // stream frames this frame takes up, 1 unless the frame rate was changed
+    // after the first frame. the rest of its time goes into frameDebt.
+    frameDebt += (double)frameRate/inputRate;
+    int slots = (int)frameDebt;
+    frameDebt -= slots;
+
+    // this frame's time is covered by dups of the last encoded frame (or it
+    // has no time of its own at all, when frames come faster than the stream)
+    if (skipFrames >= slots) {
+        skipFrames -= slots;
+        frameCount++;
+        return;
     }
-    WriteFrame(data);
+    slots -= skipFrames;
+
+    int dups = (slots > decimation ? slots : decimation) - 1;
+    WriteRun(data, dups);
+    skipFrames = dups - (slots - 1);
+    changeFraction = 1;
     frameCount++;
 }
 
@@ -78,18 +210,26 @@ void
 VideoEncoder::dupFrame(const unsigned char *data, int time)
 {
     int frames = ceil((float)time*frameRate/1000);
+
+    // every frame is a keyframe, there's nothing to dup
+    if (keyFrameInterval < 2) {
+        for (int i = 0; i < frames; i++)
+            WriteFrame(data, 0, true);
+        return;
+    }
+
     int repetitions = floor((float)frames/(keyFrameInterval-1));
     int i;
 
     if (repetitions == 0)
-        WriteFrame(data, frames);
+        WriteFrame(data, frames, true);
 
     for (i = 1; i<=repetitions; i++) {
-        WriteFrame(data, keyFrameInterval-1);
+        WriteFrame(data, keyFrameInterval-1, true);
     }
     
     int mod = frames%(keyFrameInterval-1);
-    if (mod) WriteFrame(data, mod);
+    if (mod) WriteFrame(data, mod, true);
 }
 
 void
@@ -98,72 +238,469 @@ VideoEncoder::setOutputFile(const char *fileName)
     outputFileName = fileName;
 }
 
+// Quality can be changed mid-stream, it takes effect from the next frame.
 void
 VideoEncoder::setQuality(int qquality)
 {
     quality = qquality;
+    settingsChanged = true;
+}
+
+// bufferDelay is how much the rate can be averaged over, in milliseconds
+// (0 = libtheora's default), flags are TH_RATECTL_* flags.
+void
+VideoEncoder::setBitrate(int bbitrate, int bufferDelay, int flags)
+{
+    // Theora switches to a bitrate at any time, but not back to quality mode
+    if (td && bbitrate <= 0 && bitrate > 0)
+        throw "Bitrate can't be turned off after the first frame.";
+
+    bitrate = bbitrate;
+    rateBuffer = bufferDelay;
+    rateFlags = flags;
+    rateChanged = td && bitrate > 0;
 }
 
+// Before the first frame this is the stream's frame rate. After that the
+// stream's frame rate is fixed and this is the rate frames come in at: each
+// frame is dupped (or frames are dropped) to keep the timing right.
 void
 VideoEncoder::setFrameRate(int fframeRate)
 {
-    frameRate = fframeRate;
+    if (!td)
+        frameRate = fframeRate;
+    inputRate = fframeRate;
+    frameDebt = 0;
 }
 
+// Mid-stream, the interval can't go beyond what the granule shift allows.
 void
 VideoEncoder::setKeyFrameInterval(int kkeyFrameInterval)
 {
     keyFrameInterval = kkeyFrameInterval;
+    if (td && keyFrameInterval > (1 << keyFrameShift))
+        keyFrameInterval = 1 << keyFrameShift;
+}
+
+// Lets keyframe spacing stretch up to interval frames while the video is
+// idle, 0 turns stretching off.
+void
+VideoEncoder::setMaxKeyFrameInterval(int interval)
+{
+    maxKeyFrameInterval = interval;
+}
+
+// Fraction of the frame (0-1) that has to change for a keyframe to be forced
+// on it, 0 turns it off.
+void
+VideoEncoder::setSceneChangeThreshold(double threshold)
+{
+    sceneChangeThreshold = threshold;
+}
+
+// Tells the encoder what fraction of the next frame passed to newFrame
+// changed. Without it, every frame counts as fully changed.
+void
+VideoEncoder::frameChanged(double fraction)
+{
+    changeFraction = fraction;
+    if (sceneChangeThreshold > 0 && fraction >= sceneChangeThreshold)
+        keyframePending = true;
+}
+
+// Makes the next frame passed to newFrame a keyframe.
+void
+VideoEncoder::forceKeyframe()
+{
+    keyframePending = true;
+}
+
+void
+VideoEncoder::setCrop(int x, int y, int w, int h)
+{
+    // the planes and the picture offset are sized from the crop once the
+    // encoder is set up, so the crop can't change after that
+    if (td)
+        throw "Crop can't be changed after the first frame.";
+
+    cropX = x;
+    cropY = y;
+    cropWidth = w;
+    cropHeight = h;
+}
+
+void
+VideoEncoder::setStride(int sstride)
+{
+    stride = sstride;
+}
+
+void
+VideoEncoder::setSpeed(int sspeed)
+{
+    speed = sspeed;
+    settingsChanged = true;
+}
+
+// Auto speed is the governor limited to speed levels.
+void
+VideoEncoder::setAutoSpeed(bool enabled)
+{
+    governor = enabled ? GOVERNOR_SPEED : GOVERNOR_OFF;
+    settingsChanged = true;
+}
+
+void
+VideoEncoder::setGovernor(bool enabled)
+{
+    governor = enabled ? GOVERNOR_FULL : GOVERNOR_OFF;
+    settingsChanged = true;
+}
+
+// Splits the output into segments of about seconds long or bytes big (0 =
+// no limit), each a complete video of its own. Segments are named after the
+// output file with a number before the extension. Must be called before the
+// first frame, there are no segments with two pass encoding.
+void
+VideoEncoder::setSegments(double seconds, unsigned long long bytes)
+{
+    if (td)
+        throw "Segments must be set before the first frame.";
+
+    segmentSeconds = seconds;
+    segmentBytes = bytes;
+}
+
+// Moves segments finished since the last call to segments.
+void
+VideoEncoder::takeClosedSegments(std::vector<SegmentInfo> &segments)
+{
+    segments.insert(segments.end(), closedSegments.begin(), closedSegments.end());
+    closedSegments.clear();
+}
+
+// Keeps only the last seconds or bytes (0 = no limit) of the video in memory
+// instead of writing it to a file. The ring is trimmed a keyframe group at a
+// time, so it's always a playable video. Must be called before the first
+// frame, there are no segments with a ring buffer.
+void
+VideoEncoder::setRingBuffer(double seconds, unsigned long long bytes)
+{
+    if (td)
+        throw "Ring buffer must be set before the first frame.";
+
+    ringSeconds = seconds;
+    ringBytes = bytes;
+}
+
+// Writes what's in the ring buffer to fileName as a complete video, starting
+// at time 0. Returns its duration in seconds and size in bytes.
+void
+VideoEncoder::dumpRing(const char *fileName, double &duration, unsigned long long &bytes)
+{
+    if (!Ring())
+        throw "Ring buffer is not enabled. Use setRingBuffer to enable it.";
+    if (ringHeaders.empty())
+        throw "Nothing was encoded yet.";
+
+    FILE *fp = fopen(fileName, "w");
+    if (!fp) {
+        char error_msg[256];
+        snprintf(error_msg, 256, "Could not open %s. Error: %s.",
+            fileName, strerror(errno));
+        errorMessage = error_msg;
+        throw errorMessage.c_str();
+    }
+    LOKI_ON_BLOCK_EXIT(fclose, fp);
+
+    ogg_stream_state os;
+    if (ogg_stream_init(&os, rand()))
+        throw "ogg_stream_init failed in dumpRing";
+    LOKI_ON_BLOCK_EXIT(ogg_stream_clear, &os);
+
+    ogg_packet op;
+    ogg_page og;
+    bytes = 0;
+
+    // the first header goes on a page of its own, like in WriteHeaders
+    for (size_t i = 0; i < ringHeaders.size(); i++) {
+        const RingPacket &header = ringHeaders[i];
+        op.packet = header.data.empty() ? NULL : (unsigned char *)&header.data[0];
+        op.bytes = header.data.size();
+        op.b_o_s = i == 0;
+        op.e_o_s = 0;
+        op.granulepos = 0;
+        op.packetno = i;
+        ogg_stream_packetin(&os, &op);
+        if (i == 0) {
+            while (ogg_stream_flush(&os, &og) > 0) {
+                fwrite(og.header, og.header_len, 1, fp);
+                fwrite(og.body, og.body_len, 1, fp);
+                bytes += og.header_len + og.body_len;
+            }
+        }
+    }
+    while (ogg_stream_flush(&os, &og) > 0) {
+        fwrite(og.header, og.header_len, 1, fp);
+        fwrite(og.body, og.body_len, 1, fp);
+        bytes += og.header_len + og.body_len;
+    }
+
+    // rebase granulepos so the first kept keyframe is the first frame
+    // (keyframe number 1 in the granulepos, Theora 3.2.1 counts from 1)
+    ogg_int64_t mask = ((ogg_int64_t)1 << keyFrameShift) - 1;
+    ogg_int64_t base = ring.empty() ? 0 : (ring.front().granulepos >> keyFrameShift) - 1;
+
+    for (size_t i = 0; i < ring.size(); i++) {
+        const RingPacket &packet = ring[i];
+        op.packet = packet.data.empty() ? NULL : (unsigned char *)&packet.data[0];
+        op.bytes = packet.data.size();
+        op.b_o_s = 0;
+        op.e_o_s = i == ring.size() - 1;
+        op.granulepos = (((packet.granulepos >> keyFrameShift) - base) << keyFrameShift) |
+            (packet.granulepos & mask);
+        op.packetno = ringHeaders.size() + i;
+        ogg_stream_packetin(&os, &op);
+        while (ogg_stream_pageout(&os, &og) > 0) {
+            fwrite(og.header, og.header_len, 1, fp);
+            fwrite(og.body, og.body_len, 1, fp);
+            bytes += og.header_len + og.body_len;
+        }
+    }
+    while (ogg_stream_flush(&os, &og) > 0) {
+        fwrite(og.header, og.header_len, 1, fp);
+        fwrite(og.body, og.body_len, 1, fp);
+        bytes += og.header_len + og.body_len;
+    }
+
+    if (ferror(fp))
+        throw "Failed writing ring buffer in dumpRing";
+
+    duration = (double)ring.size()/frameRate;
+}
+
+// Must be called before the first frame. Two pass encoding needs a bitrate.
+void
+VideoEncoder::setPass(int ppass)
+{
+    pass = ppass;
+    if (pass == 1)
+        passData.clear();
+    passDataPos = 0;
+}
+
+// Ends the video and gets ready for encoding it again from the first frame,
+// with the same settings.
+void
+VideoEncoder::reset()
+{
+    end();
+    frameCount = 0;
+    bytesWritten = 0;
+    degradation = 0;
+    decimation = 1;
+    skipFrames = 0;
+    frameDebt = 0;
+    encodeLoad = 0;
+    framesSinceChange = 0;
+    changeFraction = 1;
+    keyframePending = false;
+}
+
+EncoderStats
+VideoEncoder::getStats() const
+{
+    EncoderStats stats;
+    stats.frames = frameCount;
+    stats.bytesWritten = bytesWritten;
+    stats.speed = speedLevel;
+    stats.quality = qualityLevel;
+    stats.decimation = decimation;
+    stats.degradation = degradation;
+    stats.load = encodeLoad;
+    return stats;
 }
 
 void
 VideoEncoder::end()
 {
+    // the first pass ends with the final summary of the metrics, which
+    // replaces the preliminary one at the start. libtheora only writes it
+    // once it has seen the end of the stream, so drain the encoder first.
+    // Errors are thrown after cleaning up, end() runs again in the destructor.
+    const char *error = NULL;
+    if (pass == 1 && td) {
+        try {
+            WritePackets(true);
+        }
+        catch (const char *err) {
+            error = err;
+        }
+
+        if (!error) {
+            unsigned char *buf;
+            int bytes = th_encode_ctl(td, TH_ENCCTL_2PASS_OUT, &buf, sizeof(buf));
+            if (bytes > 0 && (size_t)bytes == passHeaderSize &&
+                passHeaderSize <= passData.size())
+                passData.replace(0, bytes, (const char *)buf, bytes);
+            else
+                error = "th_encode_ctl didn't give a two pass summary in end";
+        }
+    }
+
+    if (ogg_fp && Segmented()) {
+        SegmentInfo segment;
+        segment.path = segmentPath;
+        segment.index = segmentIndex++;
+        segment.duration = (double)segmentFrames/frameRate;
+        segment.bytes = bytesWritten - segmentStart;
+        closedSegments.push_back(segment);
+    }
+
     if (ogg_fp) fclose(ogg_fp);
     if (td) th_encode_free(td);
     if (ogg_os) ogg_stream_clear(ogg_os);
+    free(ogg_os);
+    for (int i = 0; i < 3; i++)
+        free(ycbcr[i].data);
     ogg_fp = NULL;
     td = NULL;
     ogg_os = NULL;
+    memset(ycbcr, 0, sizeof(ycbcr));
+
+    if (error)
+        throw error;
 }
 
 void
-VideoEncoder::InitTheora()
+VideoEncoder::FillInfo(th_info &ti)
 {
+    int frame_width = ((cropWidth + 15) >> 4) << 4; // make sure width%16==0
+    int frame_height = ((cropHeight + 15) >> 4) << 4;
+
+    // center the picture in the frame, the rest is padding. keep the offsets
+    // even so that chroma planes line up.
+    picX = ((frame_width - cropWidth)/2) & ~1;
+    picY = ((frame_height - cropHeight)/2) & ~1;
+
     th_info_init(&ti);
-    ti.frame_width = ((width + 15) >> 4) << 4; // make sure width%16==0
-    ti.frame_height = ((height + 15) >> 4) << 4;
-    ti.pic_width = width;
-    ti.pic_height = height;
-    ti.pic_x = 0;
-    ti.pic_y = 0;
+    ti.frame_width = frame_width;
+    ti.frame_height = frame_height;
+    ti.pic_width = cropWidth;
+    ti.pic_height = cropHeight;
+    ti.pic_x = picX;
+    ti.pic_y = picY;
     ti.fps_numerator = frameRate;
     ti.fps_denominator = 1;
     ti.aspect_numerator = 0;
     ti.aspect_denominator = 0;
     ti.colorspace = TH_CS_UNSPECIFIED;
     ti.pixel_fmt = TH_PF_420;
-    ti.target_bitrate = 0;
+    ti.target_bitrate = bitrate;
     ti.quality = quality;
-    ti.keyframe_granule_shift = (int)log2(keyFrameInterval);
+    // the granule shift only limits keyframe spacing, to a power of two that
+    // fits the max interval. the spacing itself is the keyframe frequency
+    // force, so intervals don't have to be powers of two.
+    int maxInterval = maxKeyFrameInterval > keyFrameInterval ?
+        maxKeyFrameInterval : keyFrameInterval;
+    int shift = 0;
+    while (shift < 31 && (1 << shift) < maxInterval)
+        shift++;
+    ti.keyframe_granule_shift = shift;
+    keyFrameShift = shift;
+}
 
-    td = th_encode_alloc(&ti);
+void
+VideoEncoder::InitTheora()
+{
+    FillInfo(ti);
+    int frame_width = ti.frame_width;
+    int frame_height = ti.frame_height;
+
+    // a preallocated context is in quality mode, set what th_info would have
+    td = encoder_pool.take(ti);
+    if (td) {
+        if (th_encode_ctl(td, TH_ENCCTL_SET_QUALITY, &quality, sizeof(quality)))
+            throw "th_encode_ctl failed for TH_ENCCTL_SET_QUALITY in InitTheora";
+    }
+    else {
+        td = th_encode_alloc(&ti);
+    }
     th_info_clear(&ti);
+    if (!td)
+        throw "th_encode_alloc failed in InitTheora";
 
     int comp=1;
     th_encode_ctl(td,TH_ENCCTL_SET_VP3_COMPATIBLE,&comp,sizeof(comp));
 
+    if (pass != 0 && bitrate <= 0)
+        throw "Two pass encoding needs a bitrate. Use setBitrate to set it.";
+
+    if (bitrate > 0)
+        ApplyBitrate();
+    rateChanged = false;
+
+    if (th_encode_ctl(td, TH_ENCCTL_GET_SPLEVEL_MAX, &maxSpeed, sizeof(maxSpeed)))
+        maxSpeed = 0;
+    speedLevel = -1; // unknown, make sure it gets set
+    qualityLevel = quality;
+    ApplyDegradation();
+    settingsChanged = false;
+    keyFrameForce = 0; // unknown, make sure it gets set
+    ApplyKeyframeForce(false, false);
+
+    if (pass == 1)
+        WritePassData(true);
+    else if (pass == 2 && th_encode_ctl(td, TH_ENCCTL_2PASS_IN, NULL, 0) < 0)
+        throw "th_encode_ctl failed for TH_ENCCTL_2PASS_IN in InitTheora";
+
     ogg_os = (ogg_stream_state *)malloc(sizeof(ogg_stream_state));
     if (!ogg_os)
         throw "malloc failed in InitTheora for ogg_stream_state";
 
     if (ogg_stream_init(ogg_os, rand()))
         throw "ogg_stream_init failed in InitTheora";
+
+    ycbcr[0].width = frame_width;
+    ycbcr[0].height = frame_height;
+    ycbcr[0].stride = frame_width;
+    ycbcr[1].width = (chroma_format == TH_PF_444) ? frame_width : (frame_width >> 1);
+    ycbcr[1].stride = ycbcr[1].width;
+    ycbcr[1].height = (chroma_format == TH_PF_420) ? (frame_height >> 1) : frame_height;
+    ycbcr[2].width = ycbcr[1].width;
+    ycbcr[2].stride = ycbcr[1].stride;
+    ycbcr[2].height = ycbcr[1].height;
+
+    for (int i = 0; i < 3; i++) {
+        ycbcr[i].data = (unsigned char *)malloc(ycbcr[i].stride * ycbcr[i].height);
+        if (!ycbcr[i].data)
+            throw "malloc failed in InitTheora for ycbcr planes";
+    }
 }
 
 void
 VideoEncoder::WriteHeaders()
 {
+    if (Ring()) {
+        ringHeaders.clear();
+        ring.clear();
+        ringUsed = 0;
+        ringKeyframes = 0;
+        th_comment_init(&tc);
+        int ret;
+        while ((ret = th_encode_flushheader(td, &tc, &op)) > 0) {
+            RingPacket header;
+            header.data.assign(op.packet, op.packet + op.bytes);
+            header.granulepos = 0;
+            header.keyframe = false;
+            ringHeaders.push_back(header);
+        }
+        th_comment_clear(&tc);
+        if (ret < 0)
+            throw "th_encode_flushheader failed in WriteHeaders";
+        return;
+    }
+
     th_comment_init(&tc);
     if (th_encode_flushheader(td, &tc, &op) <= 0)
         throw "th_encode_flushheader failed in WriteHeaders";
@@ -173,8 +710,7 @@ VideoEncoder::WriteHeaders()
     if (ogg_stream_pageout(ogg_os, &og)!=1)
         throw "ogg_stream_pageout failed in WriteHeaders";
 
-    fwrite(og.header,1,og.header_len,ogg_fp);
-    fwrite(og.body,1,og.body_len,ogg_fp);
+    WritePage(og);
 
     for (;;) {
         int ret = th_encode_flushheader(td, &tc, &op);
@@ -191,120 +727,466 @@ VideoEncoder::WriteHeaders()
             throw "ogg_stream_flush failed in WriteHeaders";
         else if (ret == 0)
             break;
-        fwrite(og.header, 1, og.header_len, ogg_fp);
-        fwrite(og.body, 1, og.body_len, ogg_fp);
+        WritePage(og);
     }
 }
 
 void
-VideoEncoder::WriteFrame(const unsigned char *rgb, int dupCount)
+VideoEncoder::WriteFrame(const unsigned char *rgb, int dupCount, bool repeat)
 {
-    th_ycbcr_buffer ycbcr;
-    ogg_packet op;
-    ogg_page og;
-    unsigned char *yuv;
-
-    unsigned long yuv_w;
-    unsigned long yuv_h;
-
-    unsigned char *yuv_y;
-    unsigned char *yuv_u;
-    unsigned char *yuv_v;
-
-    unsigned int x;
-    unsigned int y;
-
-    yuv = rgb_to_yuv(rgb, width*height*3);
-    LOKI_ON_BLOCK_EXIT(free, yuv);
-    if (!yuv)
-        throw "malloc failed in rgb_to_yuv";
-
-    yuv_w = (width + 15) & ~15;
-    yuv_h = (height + 15) & ~15;
-
-    ycbcr[0].width = yuv_w;
-    ycbcr[0].height = yuv_h;
-    ycbcr[0].stride = yuv_w;
-    ycbcr[1].width = (chroma_format == TH_PF_444) ? yuv_w : (yuv_w >> 1);
-    ycbcr[1].stride = ycbcr[1].width;
-    ycbcr[1].height = (chroma_format == TH_PF_420) ? (yuv_h >> 1) : yuv_h;
-    ycbcr[2].width = ycbcr[1].width;
-    ycbcr[2].stride = ycbcr[1].stride;
-    ycbcr[2].height = ycbcr[1].height;
-
-    yuv_y = (unsigned char*)malloc(ycbcr[0].stride * ycbcr[0].height);
-    LOKI_ON_BLOCK_EXIT(free, yuv_y);
-    if (!yuv_y)
-        throw "malloc failed in WriteFrame for yuv_y";
+    // a segment is cut by starting a new encoder, so the next one starts
+    // with headers and a keyframe of its own
+    if (SegmentFull()) {
+        end();
+        prepare();
+    }
 
-    yuv_u = (unsigned char*)malloc(ycbcr[1].stride * ycbcr[1].height);
-    LOKI_ON_BLOCK_EXIT(free, yuv_u);
-    if (!yuv_u)
-        throw "malloc failed in WriteFrame for yuv_u";
+    // a forced keyframe can't carry dups, they follow as a frame of their own
+    if (keyframePending && !repeat && dupCount > 0) {
+        WriteFrame(rgb, 0);
+        WriteFrame(rgb, dupCount - 1, true);
+        return;
+    }
 
-    yuv_v = (unsigned char*)malloc(ycbcr[2].stride * ycbcr[2].height);
-    LOKI_ON_BLOCK_EXIT(free, yuv_v);
-    if (!yuv_u)
-        throw "malloc failed in WriteFrame for yuv_v";
+    rgb_to_ycbcr(rgb + cropY*stride + cropX*3, stride, cropWidth, cropHeight,
+        ycbcr, picX, picY);
 
-    ycbcr[0].data = yuv_y;
-    ycbcr[1].data = yuv_u;
-    ycbcr[2].data = yuv_v;
+    int xdec = (chroma_format != TH_PF_444);
+    int ydec = (chroma_format == TH_PF_420);
+    pad_plane(ycbcr[0], picX, picY, cropWidth, cropHeight);
+    pad_plane(ycbcr[1], picX >> xdec, picY >> ydec,
+        (cropWidth + xdec) >> xdec, (cropHeight + ydec) >> ydec);
+    pad_plane(ycbcr[2], picX >> xdec, picY >> ydec,
+        (cropWidth + xdec) >> xdec, (cropHeight + ydec) >> ydec);
 
-    for(y = 0; y < height; y++) {
-        for(x = 0; x < width; x++) {
-            yuv_y[x + y * yuv_w] = yuv[3 * (x + y * width) + 0];
-        }
+    if (settingsChanged) {
+        ApplyDegradation();
+        settingsChanged = false;
     }
-
-    if (chroma_format == TH_PF_420) {
-        for(y = 0; y < height; y += 2) {
-            for(x = 0; x < width; x += 2) {
-                yuv_u[(x >> 1) + (y >> 1) * (yuv_w >> 1)] =
-                    yuv[3 * (x + y * width) + 1];
-                yuv_v[(x >> 1) + (y >> 1) * (yuv_w >> 1)] =
-                    yuv[3 * (x + y * width) + 2];
-            }
-        }
-    } else if (chroma_format == TH_PF_444) {
-        for(y = 0; y < height; y++) {
-            for(x = 0; x < width; x++) {
-                yuv_u[x + y * ycbcr[1].stride] = yuv[3 * (x + y * width) + 1];
-                yuv_v[x + y * ycbcr[2].stride] = yuv[3 * (x + y * width) + 2];
-            }
-        }
-    } else {  // TH_PF_422 
-        for(y = 0; y < height; y += 1) {
-            for(x = 0; x < width; x += 2) {
-                yuv_u[(x >> 1) + y * ycbcr[1].stride] =
-                    yuv[3 * (x + y * width) + 1];
-                yuv_v[(x >> 1) + y * ycbcr[2].stride] =
-                    yuv[3 * (x + y * width) + 2];
-            }
-        }    
+    if (rateChanged) {
+        ApplyBitrate();
+        rateChanged = false;
     }
 
+    double start = wall_time();
+
+    ApplyKeyframeForce(keyframePending && !repeat,
+        repeat || changeFraction < IDLE_CHANGE);
+
     if (dupCount > 0) {
         int ret = th_encode_ctl(td, TH_ENCCTL_SET_DUP_COUNT, &dupCount, sizeof(int));
         if (ret)
             throw "th_encode_ctl failed for dupCount>0";
     }
 
+    if (pass == 2)
+        ReadPassData();
+
     if(th_encode_ycbcr_in(td, ycbcr))
         throw "th_encode_ycbcr_in failed in WriteFrame";
 
-    while (int ret = th_encode_packetout(td, 0, &op)) {
+    if (pass == 1)
+        WritePassData(false);
+
+    segmentFrames += 1 + dupCount;
+    if (!repeat)
+        keyframePending = false;
+
+    WritePackets(false);
+
+    if (governor != GOVERNOR_OFF && pass == 0)
+        Govern((wall_time() - start)*frameRate/(1 + dupCount));
+}
+
+// Writes out the packets the encoder has ready. With last set it also tells
+// the encoder the stream ends here.
+void
+VideoEncoder::WritePackets(bool last)
+{
+    ogg_packet op;
+    ogg_page og;
+
+    while (int ret = th_encode_packetout(td, last, &op)) {
         if (ret < 0)
-            throw "th_encode_packetout failed in WriteFrame";
+            throw "th_encode_packetout failed in WritePackets";
+        if (Ring()) {
+            KeepPacket(op);
+            continue;
+        }
         ogg_stream_packetin(ogg_os, &op);
         while(ogg_stream_pageout(ogg_os, &og)) {
-            fwrite(og.header, og.header_len, 1, ogg_fp);
-            fwrite(og.body, og.body_len, 1, ogg_fp);
+            WritePage(og);
         }
     }
 
-    ogg_stream_flush(ogg_os, &og);
-    fwrite(og.header, og.header_len, 1, ogg_fp);
-    fwrite(og.body, og.body_len, 1, ogg_fp);
+    if (!Ring() && ogg_stream_flush(ogg_os, &og))
+        WritePage(og);
+}
+
+bool
+VideoEncoder::Segmented() const
+{
+    return (segmentSeconds > 0 || segmentBytes > 0) && pass == 0 && !Ring();
+}
+
+bool
+VideoEncoder::SegmentFull() const
+{
+    if (!Segmented() || segmentFrames == 0)
+        return false;
+    if (segmentSeconds > 0 && segmentFrames >= segmentSeconds*frameRate)
+        return true;
+    return segmentBytes > 0 && bytesWritten - segmentStart >= segmentBytes;
+}
+
+// Adds a packet to the ring buffer, then drops the oldest keyframe groups
+// while it's over the limits. The group being encoded is never dropped.
+void
+VideoEncoder::KeepPacket(const ogg_packet &packet)
+{
+    RingPacket kept;
+    kept.data.assign(packet.packet, packet.packet + packet.bytes);
+    kept.granulepos = packet.granulepos;
+    kept.keyframe = packet.bytes > 0 && th_packet_iskeyframe((ogg_packet *)&packet) == 1;
+    ring.push_back(kept);
+    ringUsed += packet.bytes;
+    if (kept.keyframe)
+        ringKeyframes++;
+
+    while (ringKeyframes > 1 &&
+        ((ringSeconds > 0 && ring.size() > ringSeconds*frameRate) ||
+         (ringBytes > 0 && ringUsed > ringBytes)))
+    {
+        do {
+            if (ring.front().keyframe)
+                ringKeyframes--;
+            ringUsed -= ring.front().data.size();
+            ring.pop_front();
+        } while (!ring.front().keyframe);
+    }
+}
+
+// "video.ogv" -> "video-0001.ogv"
+std::string
+VideoEncoder::SegmentPath(int index) const
+{
+    size_t slash = outputFileName.rfind('/');
+    size_t dot = outputFileName.rfind('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        dot = outputFileName.size();
+
+    char number[16];
+    snprintf(number, sizeof(number), "-%04d", index);
+    return outputFileName.substr(0, dot) + number + outputFileName.substr(dot);
+}
+
+// Writes the frame followed by dups repeats of it, in runs that fit between
+// keyframes.
+void
+VideoEncoder::WriteRun(const unsigned char *rgb, int dups)
+{
+    int run = keyFrameInterval > 1 ? keyFrameInterval - 1 : 0;
+
+    int n = dups < run ? dups : run;
+    WriteFrame(rgb, n);
+    dups -= n;
+
+    while (dups > 0) {
+        n = dups - 1 < run ? dups - 1 : run;
+        WriteFrame(rgb, n, true);
+        dups -= n + 1;
+    }
+}
+
+// Picks the keyframe frequency force for the next frame: 1 for a forced
+// keyframe, the max interval while idle, the keyframe interval otherwise.
+// When activity resumes after a stretch, the keyframe that's overdue lands
+// on the first busy frame.
+void
+VideoEncoder::ApplyKeyframeForce(bool keyframe, bool idle)
+{
+    int force = keyFrameInterval;
+    if (keyframe)
+        force = 1;
+    else if (idle && maxKeyFrameInterval > keyFrameInterval)
+        force = maxKeyFrameInterval;
+
+    if (force == keyFrameForce)
+        return;
+
+    ogg_uint32_t value = force;
+    if (th_encode_ctl(td, TH_ENCCTL_SET_KEYFRAME_FREQUENCY_FORCE, &value, sizeof(value)))
+        throw "th_encode_ctl failed for TH_ENCCTL_SET_KEYFRAME_FREQUENCY_FORCE";
+    keyFrameForce = force;
+}
+
+// Collects the first pass metrics the encoder has for us: the preliminary
+// summary at the start, then data of every submitted frame.
+void
+VideoEncoder::WritePassData(bool summary)
+{
+    unsigned char *buf;
+    int bytes = th_encode_ctl(td, TH_ENCCTL_2PASS_OUT, &buf, sizeof(buf));
+    if (bytes < 0)
+        throw "th_encode_ctl failed for TH_ENCCTL_2PASS_OUT";
+
+    if (summary) {
+        passData.clear();
+        passHeaderSize = bytes;
+    }
+    passData.append((const char *)buf, bytes);
 }
 
+// Feeds the encoder the first pass metrics until it has what it needs for
+// the next frame.
+void
+VideoEncoder::ReadPassData()
+{
+    for (;;) {
+        int bytes = th_encode_ctl(td, TH_ENCCTL_2PASS_IN,
+            (void *)(passData.data() + passDataPos), passData.size() - passDataPos);
+        if (bytes < 0)
+            throw "th_encode_ctl failed for TH_ENCCTL_2PASS_IN in WriteFrame";
+        if (bytes == 0)
+            break;
+        passDataPos += bytes;
+    }
+}
+
+// Sets the encoder's speed level, clamped to what it supports. Higher levels
+// encode faster at the cost of compression efficiency.
+void
+VideoEncoder::ApplySpeed(int level)
+{
+    if (level < 0) level = 0;
+    if (level > maxSpeed) level = maxSpeed;
+
+    if (level != speedLevel &&
+        th_encode_ctl(td, TH_ENCCTL_SET_SPLEVEL, &level, sizeof(level)) == 0)
+    {
+        speedLevel = level;
+    }
+}
+
+// Puts the encoder in bitrate mode with the current bitrate, buffer and
+// flags. A context from the pool (or one switched mid-stream) starts out in
+// quality mode, setting the bitrate turns rate control on.
+void
+VideoEncoder::ApplyBitrate()
+{
+    long bps = bitrate;
+    if (th_encode_ctl(td, TH_ENCCTL_SET_BITRATE, &bps, sizeof(bps)))
+        throw "th_encode_ctl failed for TH_ENCCTL_SET_BITRATE";
+    if (th_encode_ctl(td, TH_ENCCTL_SET_RATE_FLAGS, &rateFlags, sizeof(rateFlags)))
+        throw "th_encode_ctl failed for TH_ENCCTL_SET_RATE_FLAGS";
+    if (rateBuffer > 0) {
+        int frames = (int)((long long)rateBuffer*frameRate/1000);
+        if (frames < 1) frames = 1;
+        if (th_encode_ctl(td, TH_ENCCTL_SET_RATE_BUFFER, &frames, sizeof(frames)))
+            throw "th_encode_ctl failed for TH_ENCCTL_SET_RATE_BUFFER";
+    }
+}
+
+void
+VideoEncoder::ApplyQuality(int level)
+{
+    if (level < 0) level = 0;
+
+    if (level != qualityLevel &&
+        th_encode_ctl(td, TH_ENCCTL_SET_QUALITY, &level, sizeof(level)) == 0)
+    {
+        qualityLevel = level;
+    }
+}
+
+int
+VideoEncoder::MaxDegradation() const
+{
+    int speedSteps = maxSpeed > speed ? maxSpeed - speed : 0;
+    int qualitySteps = bitrate > 0 ? 0 : QUALITY_STEPS; // rate control owns quality
+
+    switch (governor) {
+    case GOVERNOR_SPEED:
+        return speedSteps;
+    case GOVERNOR_FULL:
+        return speedSteps + qualitySteps + DECIMATION_STEPS;
+    default:
+        return 0;
+    }
+}
+
+// Sets speed, quality and decimation for the current degradation level:
+// speed levels are used up first, then quality steps, then decimation.
+void
+VideoEncoder::ApplyDegradation()
+{
+    if (degradation > MaxDegradation())
+        degradation = MaxDegradation();
+
+    int speedSteps = maxSpeed > speed ? maxSpeed - speed : 0;
+    int qualitySteps = bitrate > 0 ? 0 : QUALITY_STEPS;
+    int d = degradation;
+    int s = d < speedSteps ? d : speedSteps;
+    d -= s;
+    int q = d < qualitySteps ? d : qualitySteps;
+    d -= q;
+
+    // the first pass only gathers metrics, it might as well be fast
+    ApplySpeed(pass == 1 ? maxSpeed : speed + s);
+    if (bitrate == 0)
+        ApplyQuality(quality - q*QUALITY_STEP);
+    decimation = 1 + d;
+}
+
+// The governor: load is how long encoding the last frame took relative to
+// how long it plays (dups included). When encoding can't keep up with real
+// time, degrade one step; when it's comfortably ahead, go one step back.
+void
+VideoEncoder::Govern(double load)
+{
+    encodeLoad = encodeLoad*0.9 + load*0.1;
+
+    if (++framesSinceChange < GOVERNOR_HOLD_FRAMES)
+        return;
+
+    if (encodeLoad > 1.0 && degradation < MaxDegradation())
+        degradation++;
+    else if (encodeLoad < 0.5 && degradation > 0)
+        degradation--;
+    else
+        return;
+
+    ApplyDegradation();
+    framesSinceChange = 0;
+    changeFraction = 1;
+    keyframePending = false;
+}
+
+Local<Object>
+encoder_stats_object(const EncoderStats &stats)
+{
+    Local<Object> obj = Object::New();
+    obj->Set(String::New("frames"), Number::New(stats.frames));
+    obj->Set(String::New("bytesWritten"), Number::New(stats.bytesWritten));
+    obj->Set(String::New("speed"), Integer::New(stats.speed));
+    obj->Set(String::New("quality"), Integer::New(stats.quality));
+    obj->Set(String::New("decimation"), Integer::New(stats.decimation));
+    obj->Set(String::New("degradation"), Integer::New(stats.degradation));
+    obj->Set(String::New("load"), Number::New(stats.load));
+    return obj;
+}
+
+Local<Object>
+segment_object(const SegmentInfo &segment)
+{
+    Local<Object> obj = Object::New();
+    obj->Set(String::New("path"), String::New(segment.path.c_str()));
+    obj->Set(String::New("index"), Integer::New(segment.index));
+    obj->Set(String::New("duration"), Number::New(segment.duration));
+    obj->Set(String::New("bytes"), Number::New(segment.bytes));
+    return obj;
+}
+
+// Calls callback(segment) for every segment, in order.
+void
+call_segment_callback(Handle<Function> callback, const std::vector<SegmentInfo> &segments)
+{
+    for (size_t i = 0; i < segments.size(); i++) {
+        Handle<Value> argv[1] = { segment_object(segments[i]) };
+
+        TryCatch try_catch;
+
+        callback->Call(Context::GetCurrent()->Global(), 1, argv);
+
+        if (try_catch.HasCaught())
+            FatalException(try_catch);
+    }
+}
+
+void
+VideoEncoder::WritePage(const ogg_page &page)
+{
+    if (!ogg_fp)
+        return;
+
+    fwrite(page.header, page.header_len, 1, ogg_fp);
+    fwrite(page.body, page.body_len, 1, ogg_fp);
+    bytesWritten += page.header_len + page.body_len;
+}
+
+// Reads setBitrate's options object: bufferDelay in milliseconds and
+// dropFrames, capOverflow, capUnderflow booleans. Returns an error message
+// or NULL.
+const char *
+rate_options_from_value(Handle<Value> options, int &bufferDelay, int &flags)
+{
+    bufferDelay = 0;
+    flags = TH_RATECTL_DROP_FRAMES|TH_RATECTL_CAP_OVERFLOW;
+
+    if (options->IsUndefined())
+        return NULL;
+    if (!options->IsObject())
+        return "Options must be an object.";
+
+    Local<Object> obj = options->ToObject();
+
+    Local<Value> delay = obj->Get(String::New("bufferDelay"));
+    if (!delay->IsUndefined()) {
+        if (!delay->IsInt32() || delay->Int32Value() < 0)
+            return "bufferDelay must be a non-negative integer (milliseconds).";
+        bufferDelay = delay->Int32Value();
+    }
+
+    static const struct { const char *name; int flag; } flag_options[] = {
+        { "dropFrames", TH_RATECTL_DROP_FRAMES },
+        { "capOverflow", TH_RATECTL_CAP_OVERFLOW },
+        { "capUnderflow", TH_RATECTL_CAP_UNDERFLOW }
+    };
+    for (size_t i = 0; i < sizeof(flag_options)/sizeof(flag_options[0]); i++) {
+        Local<Value> value = obj->Get(String::New(flag_options[i].name));
+        if (value->IsUndefined())
+            continue;
+        if (!value->IsBoolean())
+            return "dropFrames, capOverflow and capUnderflow must be booleans.";
+        if (value->BooleanValue())
+            flags |= flag_options[i].flag;
+        else
+            flags &= ~flag_options[i].flag;
+    }
+
+    return NULL;
+}
+
+// Reads the options object of setSegments and setRingBuffer: seconds and
+// bytes, at least one of them positive. Returns an error message or NULL.
+const char *
+limit_options_from_value(Handle<Value> options, double &seconds,
+    unsigned long long &bytes)
+{
+    seconds = 0;
+    bytes = 0;
+
+    if (!options->IsObject())
+        return "Options must be an object.";
+
+    Local<Object> obj = options->ToObject();
+
+    Local<Value> secs = obj->Get(String::New("seconds"));
+    if (!secs->IsUndefined()) {
+        if (!secs->IsNumber() || secs->NumberValue() < 0)
+            return "seconds must be a non-negative number.";
+        seconds = secs->NumberValue();
+    }
+
+    Local<Value> size = obj->Get(String::New("bytes"));
+    if (!size->IsUndefined()) {
+        if (!size->IsNumber() || size->IntegerValue() < 0)
+            return "bytes must be a non-negative number.";
+        bytes = size->IntegerValue();
+    }
+
+    if (seconds == 0 && bytes == 0)
+        return "Either seconds or bytes must be set.";
+
+    return NULL;
+}
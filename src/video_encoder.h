@@ -2,11 +2,42 @@
 #define VIDEO_ENCODER_H
 
 #include <string>
+#include <vector>
+#include <deque>
+#include <node.h>
 #include <theora/theoraenc.h>
 
+// What the encoder is doing right now, for stats() and friends.
+struct EncoderStats {
+    unsigned long frames;
+    unsigned long long bytesWritten;
+    int speed, quality, decimation;
+    int degradation; // steps the governor took down from the settings
+    double load; // encoding time / video time, averaged
+};
+
+// A finished segment of segmented output.
+struct SegmentInfo {
+    std::string path;
+    int index;
+    double duration; // seconds
+    unsigned long long bytes;
+};
+
+// An encoded packet kept in the ring buffer.
+struct RingPacket {
+    std::vector<unsigned char> data;
+    ogg_int64_t granulepos;
+    bool keyframe;
+};
+
 class VideoEncoder {
     int width, height, quality, frameRate, keyFrameInterval;
+    int bitrate, rateBuffer, rateFlags; // bitrate 0 = constant quality
+    int cropX, cropY, cropWidth, cropHeight, stride;
     std::string outputFileName;
+    // formatted messages are thrown from here, so they outlive the throw
+    std::string errorMessage;
 
     FILE *ogg_fp;
     th_info ti;
@@ -15,26 +46,145 @@ class VideoEncoder {
     ogg_packet op;
     ogg_page og;
     ogg_stream_state *ogg_os;
+    th_ycbcr_buffer ycbcr;
+    int picX, picY;
 
     unsigned long frameCount;
+    unsigned long long bytesWritten;
+
+    // speed level asked for by setSpeed, the one in effect and the highest
+    // the encoder supports. setSpeed takes effect before the next frame.
+    int speed, speedLevel, maxSpeed;
+    bool settingsChanged;
+    bool rateChanged; // setBitrate after the first frame, applied before the next
+
+    // the load governor trades speed, then quality, then frame rate for
+    // keeping up with real time. degradation is how many steps it took.
+    enum { GOVERNOR_OFF, GOVERNOR_SPEED, GOVERNOR_FULL } governor;
+    int degradation;
+    int qualityLevel; // quality in effect
+    int decimation, skipFrames; // encode every decimation'th frame only
+    double encodeLoad; // moving average of encoding time / video time
+    int framesSinceChange;
+
+    // two pass encoding: 0 = single pass, 1 = first pass, which only collects
+    // rate control metrics into passData, 2 = second pass, which uses them
+    int pass;
+    std::string passData;
+    size_t passDataPos;
+    size_t passHeaderSize; // of the summary at the start of passData
+
+    // keyframe placement: a keyframe is forced when more than
+    // sceneChangeThreshold of the frame changed, and spacing stretches up to
+    // maxKeyFrameInterval while nothing is going on
+    double sceneChangeThreshold, changeFraction;
+    int maxKeyFrameInterval;
+    int keyFrameForce; // TH_ENCCTL_SET_KEYFRAME_FREQUENCY_FORCE in effect
+    bool keyframePending;
+    int keyFrameShift; // granule shift of the stream
+
+    // frame rate frames come in at, set by setFrameRate after the first
+    // frame, and the fraction of a stream frame owed to the next frame
+    int inputRate;
+    double frameDebt;
+
+    // segmented output: a new file is started when the current one gets
+    // segmentSeconds long or segmentBytes big, whichever comes first
+    double segmentSeconds;
+    unsigned long long segmentBytes;
+    int segmentIndex;
+    unsigned long segmentFrames; // stream frames in the current segment
+    unsigned long long segmentStart; // bytesWritten when it was started
+    std::string segmentPath;
+    std::vector<SegmentInfo> closedSegments;
+
+    // ring buffer mode: instead of writing a file, packets of the last
+    // ringSeconds or ringBytes (whichever is less) are kept in memory, in
+    // whole keyframe groups, until dumpRing writes them out
+    double ringSeconds;
+    unsigned long long ringBytes;
+    std::vector<RingPacket> ringHeaders;
+    std::deque<RingPacket> ring;
+    unsigned long long ringUsed; // bytes of packet data in ring
+    int ringKeyframes; // in ring
 
 public:
     VideoEncoder(int wwidth, int hheight);
     ~VideoEncoder();
 
+    void prepare();
+    int preallocate(int count);
     void newFrame(const unsigned char *data);
     void dupFrame(const unsigned char *data, int time);
     void setOutputFile(const char *fileName);
     void setQuality(int qquality);
+    void setBitrate(int bbitrate, int bufferDelay, int flags);
     void setFrameRate(int fframeRate);
     void setKeyFrameInterval(int kkeyFrameInterval);
+    void setMaxKeyFrameInterval(int interval);
+    void setSceneChangeThreshold(double threshold);
+    void frameChanged(double fraction);
+    void forceKeyframe();
+    void setCrop(int x, int y, int w, int h);
+    void setStride(int sstride);
+    void setSpeed(int sspeed);
+    void setAutoSpeed(bool enabled);
+    void setGovernor(bool enabled);
+    void setSegments(double seconds, unsigned long long bytes);
+    void takeClosedSegments(std::vector<SegmentInfo> &segments);
+    void setRingBuffer(double seconds, unsigned long long bytes);
+    void dumpRing(const char *fileName, double &duration, unsigned long long &bytes);
+    void setPass(int ppass);
+    void reset();
+    int getSpeed() const { return speedLevel; }
+    EncoderStats getStats() const;
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    int getQuality() const { return quality; }
+    int getFrameRate() const { return frameRate; }
+    int getKeyFrameInterval() const { return keyFrameInterval; }
+    void getCrop(int &x, int &y, int &w, int &h) const
+        { x = cropX; y = cropY; w = cropWidth; h = cropHeight; }
+    // bytes newFrame reads from its input with the current crop and stride
+    size_t getInputLength() const
+        { return (size_t)(cropY + cropHeight - 1)*stride + (cropX + cropWidth)*3; }
+    void getBitrate(int &bps, int &bufferDelay, int &flags) const
+        { bps = bitrate; bufferDelay = rateBuffer; flags = rateFlags; }
+    unsigned long long getBytesWritten() const { return bytesWritten; }
     void end();
 
 private:
+    void FillInfo(th_info &ti);
     void InitTheora();
     void WriteHeaders();
-    void WriteFrame(const unsigned char *rgb, int dupCount=0);
+    void WriteFrame(const unsigned char *rgb, int dupCount=0, bool repeat=false);
+    void WriteRun(const unsigned char *rgb, int dups);
+    void WritePackets(bool last);
+    bool Segmented() const;
+    bool Ring() const { return ringSeconds > 0 || ringBytes > 0; }
+    bool SegmentFull() const;
+    void KeepPacket(const ogg_packet &packet);
+    std::string SegmentPath(int index) const;
+    void ApplyKeyframeForce(bool keyframe, bool idle);
+    void WritePage(const ogg_page &page);
+    void ApplySpeed(int level);
+    void ApplyQuality(int level);
+    void ApplyBitrate();
+    int MaxDegradation() const;
+    void ApplyDegradation();
+    void Govern(double load);
+    void WritePassData(bool summary);
+    void ReadPassData();
 };
 
+v8::Local<v8::Object> encoder_stats_object(const EncoderStats &stats);
+v8::Local<v8::Object> segment_object(const SegmentInfo &segment);
+void call_segment_callback(v8::Handle<v8::Function> callback,
+    const std::vector<SegmentInfo> &segments);
+const char *rate_options_from_value(v8::Handle<v8::Value> options,
+    int &bufferDelay, int &flags);
+const char *limit_options_from_value(v8::Handle<v8::Value> options,
+    double &seconds, unsigned long long &bytes);
+
 #endif
 
@@ -0,0 +1,86 @@
+var VideoLib = require('video');
+var Buffer = require('buffer').Buffer;
+var fs = require('fs');
+var sys = require('sys');
+
+// Records synthetic frames into a three second ring buffer and dumps it
+// twice, checking the dumps hold between the limit minus a keyframe interval
+// and the limit. Also checks the calls that have to come before the first
+// frame throw after it, and that a failing dump says why.
+
+var width = 320, height = 240;
+var frameRate = 10;
+
+function frame(n) {
+    var rgb = new Buffer(width*height*3);
+    for (var y = 0; y < height; y++) {
+        for (var x = 0; x < width; x++) {
+            var i = (y*width + x)*3;
+            rgb[i] = (x*2 + n*3) & 0xff;
+            rgb[i+1] = (y*2 - n) & 0xff;
+            rgb[i+2] = (n*8) & 0xff;
+        }
+    }
+    return rgb;
+}
+
+function mustThrow(what, f) {
+    try {
+        f();
+    }
+    catch (e) {
+        console.log('Rejected as expected: ' + e.message);
+        return e;
+    }
+    console.log('FAIL: ' + what + ' was accepted');
+    process.exit(1);
+}
+
+function checkDump(fileName, dumped) {
+    var data = fs.readFileSync(fileName);
+    console.log(fileName + ': ' + dumped.duration + 's, ' + dumped.bytes + ' bytes');
+    if (data.length != dumped.bytes || data.toString('ascii', 0, 4) != 'OggS') {
+        console.log('FAIL: ' + fileName + ' is not the video dumped');
+        process.exit(1);
+    }
+    if (dumped.duration < 2 || dumped.duration > 3) {
+        console.log('FAIL: ' + fileName + ' is ' + dumped.duration + 's long');
+        process.exit(1);
+    }
+}
+
+var video = new VideoLib.FixedVideo(width, height);
+video.setFrameRate(frameRate);
+video.setKeyFrameInterval(frameRate);
+video.setRingBuffer({ seconds: 3 });
+
+mustThrow('dumping before the first frame', function () {
+    video.dumpRing('ring-early.ogv');
+});
+
+for (var n = 0; n < 100; n++)
+    video.newFrame(frame(n));
+
+mustThrow('setRingBuffer after the first frame', function () {
+    video.setRingBuffer({ seconds: 10 });
+});
+mustThrow('setSegments after the first frame', function () {
+    video.setSegments({ seconds: 10 });
+});
+var e = mustThrow('dumping to a missing directory', function () {
+    video.dumpRing('./no/such/dir/ring.ogv');
+});
+if (e.message.indexOf('no/such/dir') == -1) {
+    console.log('FAIL: error message is garbled: ' + e.message);
+    process.exit(1);
+}
+
+checkDump('ring-1.ogv', video.dumpRing('ring-1.ogv'));
+
+for (var n = 100; n < 150; n++)
+    video.newFrame(frame(n));
+
+checkDump('ring-2.ogv', video.dumpRing('ring-2.ogv'));
+
+video.end();
+console.log('OK');
@@ -0,0 +1,64 @@
+var VideoLib = require('video');
+var Buffer = require('buffer').Buffer;
+var fs = require('fs');
+var sys = require('sys');
+
+// Writes synthetic frames with segments of two seconds and checks that
+// every segment is announced once, in order, and is a video file of its own.
+
+var width = 320, height = 240;
+var frameRate = 10;
+var frames = 65;
+
+function frame(n) {
+    var rgb = new Buffer(width*height*3);
+    for (var y = 0; y < height; y++) {
+        for (var x = 0; x < width; x++) {
+            var i = (y*width + x)*3;
+            rgb[i] = (x + n*4) & 0xff;
+            rgb[i+1] = (y + n*2) & 0xff;
+            rgb[i+2] = (x ^ y) & 0xff;
+        }
+    }
+    return rgb;
+}
+
+var segments = [];
+
+var video = new VideoLib.FixedVideo(width, height);
+video.setOutputFile('segments.ogv');
+video.setFrameRate(frameRate);
+video.setKeyFrameInterval(frameRate);
+video.setSegments({ seconds: 2 }, function (segment) {
+    console.log(segment.path + ': ' + segment.duration + 's, ' +
+        segment.bytes + ' bytes');
+    segments.push(segment);
+});
+
+for (var n = 0; n < frames; n++)
+    video.newFrame(frame(n));
+video.end();
+
+var expected = Math.ceil(frames/(2*frameRate));
+if (segments.length != expected) {
+    console.log('FAIL: ' + segments.length + ' segments, expected ' + expected);
+    process.exit(1);
+}
+
+segments.forEach(function (segment, i) {
+    if (segment.index != i) {
+        console.log('FAIL: segment ' + i + ' has index ' + segment.index);
+        process.exit(1);
+    }
+    var data = fs.readFileSync(segment.path);
+    if (data.length != segment.bytes || data.toString('ascii', 0, 4) != 'OggS') {
+        console.log('FAIL: ' + segment.path + ' is not the video announced');
+        process.exit(1);
+    }
+    if (i < segments.length - 1 && segment.duration < 2) {
+        console.log('FAIL: ' + segment.path + ' is only ' + segment.duration + 's');
+        process.exit(1);
+    }
+});
+
+console.log('OK');
@@ -0,0 +1,84 @@
+var VideoLib = require('video');
+var Buffer = require('buffer').Buffer;
+var fs = require('fs');
+var sys = require('sys');
+
+// Encodes the frames with a progress callback and aborts at the first report.
+// Checks that progress only goes forward, that the callback says the encode
+// was aborted and that fewer frames than pushed got encoded.
+
+var chunkDirs = fs.readdirSync('.').sort().filter(
+    function (f) {
+        return /^\d+$/.test(f);
+    }
+);
+
+function rectDim(fileName) {
+    var m = fileName.match(/^\d+-rgb-(\d+)-(\d+)-(\d+)-(\d+).dat$/);
+    var dim = [m[1], m[2], m[3], m[4]].map(function (n) {
+        return parseInt(n, 10);
+    });
+    return { x: dim[0], y: dim[1], w: dim[2], h: dim[3] }
+}
+
+var stackedVideo = new VideoLib.AsyncStackedVideo(720,400);
+stackedVideo.setOutputFile('video-abort.ogv');
+stackedVideo.setTmpDir('./abort');
+// slowest speed level, so there's time to abort
+stackedVideo.setSpeed(0);
+
+var pushed = 0;
+// push the frames a few times over so the encode takes a while
+for (var round = 0; round < 4; round++) {
+    chunkDirs.forEach(function (dir) {
+        var chunkFiles = fs.readdirSync(dir).sort().filter(
+            function (f) {
+                return /^\d+-rgb-\d+-\d+-\d+-\d+.dat/.test(f);
+            }
+        );
+        chunkFiles.forEach(function (chunkFile) {
+            var dims = rectDim(chunkFile);
+            var rgb = fs.readFileSync(dir + '/' + chunkFile);
+            stackedVideo.push(rgb, dims.x, dims.y, dims.w, dims.h);
+        });
+        stackedVideo.endPush();
+        pushed++;
+    });
+}
+
+var lastDone = -1;
+var reports = 0;
+
+stackedVideo.encode(function (status, error, stats) {
+    if (!status) {
+        console.log('FAIL: encoding failed: ' + error);
+        process.exit(1);
+    }
+    console.log(reports + ' progress reports, ' + stats.frames + ' of ' +
+        pushed + ' frames encoded');
+    if (!stats.aborted) {
+        console.log('FAIL: stats.aborted is not set');
+        process.exit(1);
+    }
+    if (stats.frames >= pushed) {
+        console.log('FAIL: all frames were encoded despite abort');
+        process.exit(1);
+    }
+    console.log('OK');
+}, function (progress) {
+    reports++;
+    if (progress.framesDone < lastDone) {
+        console.log('FAIL: framesDone went from ' + lastDone + ' to ' +
+            progress.framesDone);
+        process.exit(1);
+    }
+    if (progress.framesTotal != pushed) {
+        console.log('FAIL: framesTotal is ' + progress.framesTotal +
+            ', pushed ' + pushed);
+        process.exit(1);
+    }
+    lastDone = progress.framesDone;
+    console.log(progress.framesDone + '/' + progress.framesTotal +
+        ', eta ' + progress.eta + 's');
+    stackedVideo.abort();
+});
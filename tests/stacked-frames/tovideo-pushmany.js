@@ -0,0 +1,83 @@
+var VideoLib = require('video');
+var Buffer = require('buffer').Buffer;
+var fs = require('fs');
+var sys = require('sys');
+
+// Same frames as tovideo.js, but every chunk is pushed with a single
+// pushMany call. Odd chunks pass their rectangles as an Int32Array, even
+// chunks as a Buffer sliced at an odd byte offset, so the unaligned Buffer
+// path gets exercised too.
+
+var chunkDirs = fs.readdirSync('.').sort().filter(
+    function (f) {
+        return /^\d+$/.test(f);
+    }
+);
+
+function rectDim(fileName) {
+    var m = fileName.match(/^\d+-rgb-(\d+)-(\d+)-(\d+)-(\d+).dat$/);
+    var dim = [m[1], m[2], m[3], m[4]].map(function (n) {
+        return parseInt(n, 10);
+    });
+    return { x: dim[0], y: dim[1], w: dim[2], h: dim[3] }
+}
+
+function unalignedRects(values) {
+    var buf = new Buffer(values.length*4 + 1);
+    var rects = buf.slice(1);
+    for (var i = 0; i < values.length; i++) {
+        var v = values[i];
+        rects[i*4] = v & 0xff;
+        rects[i*4+1] = (v >> 8) & 0xff;
+        rects[i*4+2] = (v >> 16) & 0xff;
+        rects[i*4+3] = (v >> 24) & 0xff;
+    }
+    return rects;
+}
+
+var stackedVideo = new VideoLib.StackedVideo(720,400);
+stackedVideo.setOutputFile('video-pushmany.ogv');
+
+chunkDirs.forEach(function (dir, n) {
+    console.log(dir);
+    var chunkFiles = fs.readdirSync(dir).sort().filter(
+        function (f) {
+            return /^\d+-rgb-\d+-\d+-\d+-\d+.dat/.test(f);
+        }
+    );
+
+    var parts = [];
+    var values = [];
+    var offset = 0;
+    chunkFiles.forEach(function (chunkFile) {
+        var dims = rectDim(chunkFile);
+        var rgb = fs.readFileSync(dir + '/' + chunkFile);
+        parts.push(rgb);
+        values.push(dims.x, dims.y, dims.w, dims.h, offset);
+        offset += rgb.length;
+    });
+
+    var rgb = new Buffer(offset);
+    offset = 0;
+    parts.forEach(function (part) {
+        part.copy(rgb, offset, 0);
+        offset += part.length;
+    });
+
+    var rects = n % 2 ? new Int32Array(values) : unalignedRects(values);
+    stackedVideo.pushMany(rgb, rects);
+    stackedVideo.endPush();
+});
+
+// A rectangle that doesn't fit must reject the whole call.
+try {
+    stackedVideo.pushMany(new Buffer(3*4*4), [0, 0, 4, 4, 0, 718, 0, 4, 4, 0]);
+    console.log('FAIL: out of bounds rectangle was accepted');
+    process.exit(1);
+}
+catch (e) {
+    console.log('Rejected as expected: ' + e.message);
+}
+
+stackedVideo.end();
+console.log('Wrote video-pushmany.ogv');
@@ -0,0 +1,88 @@
+var VideoLib = require('video');
+var Buffer = require('buffer').Buffer;
+var fs = require('fs');
+var sys = require('sys');
+var exec = require('child_process').exec;
+
+// Pushes the frames in a child process with a small memory limit, so they
+// spill to the journal, and lets it exit without encoding. Then recovers the
+// video from the store it left behind. Run it again with 'incremental' as
+// argument to have the child encode incrementally, recover then skips the
+// frames the child already encoded.
+//
+//     node tovideo-recover.js [incremental]
+
+var chunkDirs = fs.readdirSync('.').sort().filter(
+    function (f) {
+        return /^\d+$/.test(f);
+    }
+);
+
+function rectDim(fileName) {
+    var m = fileName.match(/^\d+-rgb-(\d+)-(\d+)-(\d+)-(\d+).dat$/);
+    var dim = [m[1], m[2], m[3], m[4]].map(function (n) {
+        return parseInt(n, 10);
+    });
+    return { x: dim[0], y: dim[1], w: dim[2], h: dim[3] }
+}
+
+var incremental = process.argv[2] == 'incremental' || process.argv[3] == 'incremental';
+var tmpDir = './recover-' + (incremental ? 'incremental' : 'spilled');
+
+if (process.argv[2] == 'child') {
+    var stackedVideo = new VideoLib.AsyncStackedVideo(720,400);
+    stackedVideo.setOutputFile('video-crashed.ogv');
+    stackedVideo.setTmpDir(tmpDir);
+    stackedVideo.setMemoryLimit(1024*1024);
+    stackedVideo.setIncrementalEncoding(incremental);
+
+    chunkDirs.forEach(function (dir) {
+        var chunkFiles = fs.readdirSync(dir).sort().filter(
+            function (f) {
+                return /^\d+-rgb-\d+-\d+-\d+-\d+.dat/.test(f);
+            }
+        );
+        chunkFiles.forEach(function (chunkFile) {
+            var dims = rectDim(chunkFile);
+            var rgb = fs.readFileSync(dir + '/' + chunkFile);
+            stackedVideo.push(rgb, dims.x, dims.y, dims.w, dims.h);
+        });
+        stackedVideo.endPush();
+    });
+
+    // give the writer time to spill, then die without calling encode
+    setTimeout(function () {
+        process.exit(0);
+    }, 3000);
+}
+else {
+    exec(process.argv[0] + ' ' + process.argv[1] + ' child' +
+        (incremental ? ' incremental' : ''),
+        function (error) {
+            if (error) {
+                console.log('FAIL: child failed: ' + error);
+                process.exit(1);
+            }
+
+            VideoLib.AsyncStackedVideo.recover(tmpDir, './video-recovered.ogv',
+                function (ok, error, stats) {
+                    if (!ok) {
+                        console.log('FAIL: recover failed: ' + error);
+                        process.exit(1);
+                    }
+                    console.log(stats.frames + ' of ' + chunkDirs.length +
+                        ' frames recovered to video-recovered.ogv');
+                    if (!incremental && stats.frames == 0) {
+                        console.log('FAIL: nothing spilled to the journal');
+                        process.exit(1);
+                    }
+                    if (stats.frames > chunkDirs.length) {
+                        console.log('FAIL: more frames recovered than pushed');
+                        process.exit(1);
+                    }
+                    console.log('OK');
+                }
+            );
+        }
+    );
+}
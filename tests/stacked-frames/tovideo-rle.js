@@ -0,0 +1,108 @@
+var VideoLib = require('video');
+var Buffer = require('buffer').Buffer;
+var fs = require('fs');
+var sys = require('sys');
+
+// Encodes the frames twice with AsyncStackedVideo, once with fragments
+// stored raw and once RLE compressed, then checks that both videos have the
+// same packets. Serial numbers differ between the two, so ogg pages are
+// compared by granule position and body only. A few very narrow fragments
+// are pushed at the end, as their repeats from the row above span rows.
+
+var chunkDirs = fs.readdirSync('.').sort().filter(
+    function (f) {
+        return /^\d+$/.test(f);
+    }
+);
+
+function rectDim(fileName) {
+    var m = fileName.match(/^\d+-rgb-(\d+)-(\d+)-(\d+)-(\d+).dat$/);
+    var dim = [m[1], m[2], m[3], m[4]].map(function (n) {
+        return parseInt(n, 10);
+    });
+    return { x: dim[0], y: dim[1], w: dim[2], h: dim[3] }
+}
+
+function stripes(w, h) {
+    var rgb = new Buffer(w*h*3);
+    for (var i = 0; i < w*h; i++) {
+        var c = (i % 3) == 0 ? 0xff : 0x20;
+        rgb[i*3] = c;
+        rgb[i*3+1] = 0x80;
+        rgb[i*3+2] = 0xff - c;
+    }
+    return rgb;
+}
+
+function oggPages(fileName) {
+    var data = fs.readFileSync(fileName);
+    var pages = [];
+    var pos = 0;
+    while (pos < data.length) {
+        if (data.toString('ascii', pos, pos + 4) != 'OggS')
+            throw new Error(fileName + ': no ogg page at ' + pos);
+        var segments = data[pos + 26];
+        var bodyLength = 0;
+        for (var i = 0; i < segments; i++)
+            bodyLength += data[pos + 27 + i];
+        var headerLength = 27 + segments;
+        pages.push({
+            granule: data.toString('hex', pos + 6, pos + 14),
+            body: data.toString('hex', pos + headerLength, pos + headerLength + bodyLength)
+        });
+        pos += headerLength + bodyLength;
+    }
+    return pages;
+}
+
+function encode(compress, fileName, done) {
+    var video = new VideoLib.AsyncStackedVideo(720,400);
+    video.setOutputFile(fileName);
+    video.setTmpDir('./rle-' + (compress ? 'packed' : 'raw'));
+    video.setFragmentCompression(compress);
+
+    chunkDirs.forEach(function (dir) {
+        var chunkFiles = fs.readdirSync(dir).sort().filter(
+            function (f) {
+                return /^\d+-rgb-\d+-\d+-\d+-\d+.dat/.test(f);
+            }
+        );
+        chunkFiles.forEach(function (chunkFile) {
+            var dims = rectDim(chunkFile);
+            var rgb = fs.readFileSync(dir + '/' + chunkFile);
+            video.push(rgb, dims.x, dims.y, dims.w, dims.h);
+        });
+        video.endPush();
+    });
+
+    [1, 2, 3, 5].forEach(function (w) {
+        video.push(stripes(w, 300), 100*w, 50, w, 300);
+        video.endPush();
+    });
+
+    video.encode(function (status, error) {
+        if (!status) {
+            console.log('FAIL: encoding ' + fileName + ': ' + error);
+            process.exit(1);
+        }
+        done();
+    });
+}
+
+encode(false, 'video-rle-raw.ogv', function () {
+    encode(true, 'video-rle-packed.ogv', function () {
+        var raw = oggPages('video-rle-raw.ogv');
+        var packed = oggPages('video-rle-packed.ogv');
+        if (raw.length != packed.length) {
+            console.log('FAIL: ' + raw.length + ' pages raw, ' + packed.length + ' compressed');
+            process.exit(1);
+        }
+        for (var i = 0; i < raw.length; i++) {
+            if (raw[i].granule != packed[i].granule || raw[i].body != packed[i].body) {
+                console.log('FAIL: page ' + i + ' differs');
+                process.exit(1);
+            }
+        }
+        console.log('OK: ' + raw.length + ' identical pages');
+    });
+});
@@ -0,0 +1,59 @@
+var VideoLib = require('video');
+var Buffer = require('buffer').Buffer;
+var fs = require('fs');
+var sys = require('sys');
+
+// Synthetic scrolling terminal: every frame scrolls the screen up one text
+// line with copyRect, clears the bottom line with fillRect and pushes a new
+// colored bar into it. No input frames needed.
+
+var width = 720, height = 400;
+var lineHeight = 16;
+var frames = 200;
+
+function bar(w, h, color) {
+    var rgb = new Buffer(w*h*3);
+    for (var i = 0; i < w*h; i++) {
+        rgb[i*3] = (color >> 16) & 0xff;
+        rgb[i*3+1] = (color >> 8) & 0xff;
+        rgb[i*3+2] = color & 0xff;
+    }
+    return rgb;
+}
+
+var stackedVideo = new VideoLib.StackedVideo(width, height);
+stackedVideo.setOutputFile('video-scroll.ogv');
+
+stackedVideo.push(bar(width, height, 0x000000), 0, 0, width, height);
+stackedVideo.endPush();
+
+for (var n = 0; n < frames; n++) {
+    var w = 40 + (n*37) % (width - 40);
+    stackedVideo.copyRect(0, lineHeight, 0, 0, width, height - lineHeight);
+    stackedVideo.fillRect(0, height - lineHeight, width, lineHeight, 0x000000);
+    stackedVideo.push(bar(w, lineHeight - 4, (n*0x1f3d5b) & 0xffffff),
+        0, height - lineHeight + 2, w, lineHeight - 4);
+    stackedVideo.endPush();
+}
+
+// Overlapping copy the other way, to exercise the backwards copy.
+stackedVideo.copyRect(0, 0, 0, lineHeight, width, height - lineHeight);
+stackedVideo.endPush();
+
+// Rectangles outside the frame must throw.
+[
+    function () { stackedVideo.copyRect(0, 0, 1, 0, width, height); },
+    function () { stackedVideo.fillRect(width - 1, 0, 2, 1, 0xffffff); }
+].forEach(function (f) {
+    try {
+        f();
+        console.log('FAIL: out of bounds rectangle was accepted');
+        process.exit(1);
+    }
+    catch (e) {
+        console.log('Rejected as expected: ' + e.message);
+    }
+});
+
+stackedVideo.end();
+console.log('Wrote video-scroll.ogv');
@@ -0,0 +1,88 @@
+var VideoLib = require('video');
+var Buffer = require('buffer').Buffer;
+var fs = require('fs');
+var sys = require('sys');
+
+// Encodes the frames for a bitrate with two passes, checking that the
+// progress callback goes through both passes and that two pass encoding
+// and incremental encoding can't be turned on together.
+
+var chunkDirs = fs.readdirSync('.').sort().filter(
+    function (f) {
+        return /^\d+$/.test(f);
+    }
+);
+
+function rectDim(fileName) {
+    var m = fileName.match(/^\d+-rgb-(\d+)-(\d+)-(\d+)-(\d+).dat$/);
+    var dim = [m[1], m[2], m[3], m[4]].map(function (n) {
+        return parseInt(n, 10);
+    });
+    return { x: dim[0], y: dim[1], w: dim[2], h: dim[3] }
+}
+
+function mustThrow(what, f) {
+    try {
+        f();
+    }
+    catch (e) {
+        console.log('Rejected as expected: ' + e.message);
+        return;
+    }
+    console.log('FAIL: ' + what + ' was accepted');
+    process.exit(1);
+}
+
+var stackedVideo = new VideoLib.AsyncStackedVideo(720,400);
+stackedVideo.setOutputFile('video-twopass.ogv');
+stackedVideo.setTmpDir('./twopass');
+stackedVideo.setBitrate(200000);
+
+stackedVideo.setIncrementalEncoding(true);
+mustThrow('two pass with incremental encoding', function () {
+    stackedVideo.setTwoPass(true);
+});
+stackedVideo.setIncrementalEncoding(false);
+
+stackedVideo.setTwoPass(true);
+mustThrow('incremental encoding with two pass', function () {
+    stackedVideo.setIncrementalEncoding(true);
+});
+
+chunkDirs.forEach(function (dir) {
+    var chunkFiles = fs.readdirSync(dir).sort().filter(
+        function (f) {
+            return /^\d+-rgb-\d+-\d+-\d+-\d+.dat/.test(f);
+        }
+    );
+    chunkFiles.forEach(function (chunkFile) {
+        var dims = rectDim(chunkFile);
+        var rgb = fs.readFileSync(dir + '/' + chunkFile);
+        stackedVideo.push(rgb, dims.x, dims.y, dims.w, dims.h);
+    });
+    stackedVideo.endPush();
+});
+
+var passesSeen = {};
+
+stackedVideo.encode(function (status, error, stats) {
+    if (!status) {
+        console.log('FAIL: encoding failed: ' + error);
+        process.exit(1);
+    }
+    console.log(stats.frames + ' frames, ' + stats.bytesWritten + ' bytes in ' +
+        stats.totalTime + 'ms');
+    if (!passesSeen[2]) {
+        console.log('FAIL: no progress report from the second pass');
+        process.exit(1);
+    }
+    console.log('OK, wrote video-twopass.ogv');
+}, function (progress) {
+    if (progress.passes != 2) {
+        console.log('FAIL: progress.passes is ' + progress.passes);
+        process.exit(1);
+    }
+    passesSeen[progress.pass] = true;
+    console.log('pass ' + progress.pass + ': ' + progress.framesDone + '/' +
+        progress.framesTotal);
+});